@@ -1,39 +1,191 @@
 #include "tarstream.hh"
+#include "digest.hh"
+#include "stats.hh"
+#include <cstring>
 #include <iostream>
 #include <string>
 
-int main(int argc, char** argv)
+// Counters and timers are only there in builds with make STATS=1
+static void print_stats()
+{
+#ifdef TAR_STATS
+    TAR::print_stats(std::cerr);
+#else
+    std::cerr << "Statistics were not compiled in, rebuild with make STATS=1\n";
+#endif
+}
+
+static int run(int argc, char** argv)
 {
+    TAR::Backend  backend     = TAR::Backend::STREAM;
+    std::uint32_t threads     = 1;
+    std::size_t   buffer_size = TAR::DEFAULT_BUFFER_SIZE;
+    bool          stats       = false;
+    bool          direct      = false;
+    bool          numeric     = false;
+    bool          append      = false;
+    bool          sparse      = false;
+    bool          dedupe      = false;
+    bool          seekable    = false;
+    TAR::Format   format      = TAR::Format::GNU;
+    std::string   snapshot;
+    std::string   manifest;
+    TAR::Matcher  matcher;
+    TAR::Digest   digest = TAR::Digest::NONE;
+
+    // -j uses one thread per core, -jN uses N threads
+    while (argc > 1 && argv[1][0] == '-')
+    {
+        if (!std::strcmp(argv[1], "--uring"))
+            backend = TAR::Backend::URING;
+        else if (!std::strcmp(argv[1], "--direct"))
+            direct = true;
+        else if (!std::strcmp(argv[1], "--numeric-owner"))
+            numeric = true;
+        else if (!std::strcmp(argv[1], "--stats"))
+            stats = true;
+        else if (!std::strcmp(argv[1], "--append"))
+            append = true;
+        else if (!std::strcmp(argv[1], "--sparse"))
+            sparse = true;
+        else if (!std::strcmp(argv[1], "--dedupe"))
+            dedupe = true;
+        else if (!std::strcmp(argv[1], "--seekable"))
+            seekable = true;
+        else if (!std::strcmp(argv[1], "--pax"))
+            format = TAR::Format::PAX;
+        else if (!std::strcmp(argv[1], "--incremental") && argc > 2)
+        {
+            snapshot = argv[2];
+            argv++;
+            argc--;
+        }
+        else if (!std::strcmp(argv[1], "--buffer-size") && argc > 2)
+        {
+            buffer_size = std::stoul(argv[2]);
+            argv++;
+            argc--;
+        }
+        else if (!std::strcmp(argv[1], "--digest") && argc > 2)
+        {
+            digest = TAR::parse_digest(argv[2]);
+            if (digest == TAR::Digest::NONE)
+            {
+                std::cerr << "Unknown digest " << argv[2] << ", use sha256 or xxh64\n";
+                return 1;
+            }
+            argv++;
+            argc--;
+        }
+        else if (!std::strcmp(argv[1], "--manifest") && argc > 2)
+        {
+            manifest = argv[2];
+            argv++;
+            argc--;
+        }
+        else if (!std::strcmp(argv[1], "--include") && argc > 2)
+        {
+            matcher.include(argv[2]);
+            argv++;
+            argc--;
+        }
+        else if (!std::strcmp(argv[1], "--exclude") && argc > 2)
+        {
+            matcher.exclude(argv[2]);
+            argv++;
+            argc--;
+        }
+        else if (std::string(argv[1]).starts_with("-j"))
+            threads = argv[1][2] ? std::stoul(argv[1] + 2) : 0;
+        else
+            break;
+        argv++;
+        argc--;
+    }
+
     if (argc != 2 && argc != 3)
     {
-        std::cerr << "Usage: archiver input_directory [output_name]\n";
+        std::cerr << "Usage: archiver [--uring] [--direct] [--numeric-owner] [--pax] [--sparse] [--dedupe] [--seekable] [--append] [--incremental snapshot] [--buffer-size bytes] [--digest sha256|xxh64] [--manifest file] [--include pattern]... [--exclude pattern]... [--stats] [-j[threads]] input_directory [output_name[.tar|.tar.gz|.tgz|.tar.zst]]\n";
         return 1;
     }
 
-    TAR::Archiver archiver;
-    if (argc == 3)
+    if (buffer_size > TAR::MAX_BUFFER_SIZE)
     {
-        std::string dest(argv[2]);
-        auto        tar_extension = dest.find(".tar");
-        if (tar_extension == std::string::npos)
-            dest += ".tar";
+        std::cerr << "--buffer-size can be at most " << TAR::MAX_BUFFER_SIZE << " bytes\n";
+        return 1;
+    }
 
-        if (archiver.archive(argv[1], dest) != TAR::Status::OK)
-        {
-            std::cerr << "Error: could not archive!\n";
-            return 1;
-        }
+    std::string dest(argc == 3 ? argv[2] : argv[1]);
+    auto        tar_extension = dest.find(".tar");
+    if (argc == 2 || (tar_extension == std::string::npos && !dest.ends_with(".tgz")))
+        dest += ".tar";
+
+    // The compression is picked by the extension
+    TAR::Codec codec = TAR::Codec::NONE;
+    if (argc == 3 && (dest.ends_with(".gz") || dest.ends_with(".tgz")))
+        codec = TAR::Codec::GZIP;
+    else if (argc == 3 && dest.ends_with(".zst"))
+        codec = TAR::Codec::ZSTD;
+
+    // Caught here rather than by OutStream, which would have truncated an
+    // existing archive by then
+    if (seekable && codec != TAR::Codec::ZSTD)
+    {
+        std::cerr << "--seekable needs a .tar.zst output\n";
+        return 1;
     }
-    else
+    if (append && codec != TAR::Codec::NONE)
     {
-        std::string dest(argv[1]);
-        dest += ".tar";
-        if (archiver.archive(argv[1], dest) != TAR::Status::OK)
+        std::cerr << "--append needs an uncompressed .tar output\n";
+        return 1;
+    }
+
+    // --digest adds records to the archive, --manifest on its own only hashes
+    // for the manifest, in sha256sum format by default
+    TAR::Digest manifest_digest = TAR::Digest::NONE;
+    if (!manifest.empty())
+        manifest_digest = digest != TAR::Digest::NONE ? digest : TAR::Digest::SHA256;
+
+    TAR::Archiver archiver(threads, numeric, format, sparse, dedupe, std::move(matcher), digest, manifest_digest);
+    if (!TAR::fs::exists(argv[1]))
+    {
+        std::cerr << argv[1] << " does not exist!\n";
+        return 1;
+    }
+
+    {
+        TAR::OutStream out(dest, 20, codec, archiver.threads(), backend, buffer_size, direct, append, seekable);
+        TAR::Status    st = snapshot.empty() ? archiver.archive(argv[1], out) : archiver.archive(argv[1], out, snapshot);
+        if (st == TAR::Status::OK)
+            st = out.close();
+        if (st != TAR::Status::OK)
         {
             std::cerr << "Error: could not archive!\n";
             return 1;
         }
     }
 
+    if (!manifest.empty() && TAR::write_manifest(manifest, archiver.digests()) != TAR::Status::OK)
+        return 1;
+
+    if (stats)
+    {
+        std::cerr << "Owner names: " << archiver.names().hits() << " cache hits, " << archiver.names().misses() << " lookups\n";
+        print_stats();
+    }
+
     return 0;
 }
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        return run(argc, argv);
+    }
+    catch (const std::exception& error)
+    {
+        std::cerr << "Error: " << error.what() << '\n';
+        return 1;
+    }
+}
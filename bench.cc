@@ -0,0 +1,639 @@
+#include "tarstream.hh"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+struct Result
+{
+    std::string   scenario;
+    std::string   path;
+    std::uint64_t files    = 0;
+    std::uint64_t bytes    = 0;
+    double        seconds  = 0;
+    std::uint64_t syscalls = 0;
+    long          peak_rss = 0; // KiB
+
+    double files_per_second() const { return seconds > 0 ? files / seconds : 0; }
+
+    double mib_per_second() const { return seconds > 0 ? bytes / seconds / (1 << 20) : 0; }
+};
+
+// read(2)/write(2) like calls of the process so far(syscr + syscw). Calls
+// that move no data through the process, e.g. copy_file_range or io_uring,
+// are not counted.
+std::uint64_t io_syscalls()
+{
+    std::ifstream proc("/proc/self/io");
+    std::string   key;
+    std::uint64_t value, total = 0;
+    while (proc >> key >> value)
+        if (key == "syscr:" || key == "syscw:")
+            total += value;
+
+    return total;
+}
+
+// Make the next peak_rss call report the peak from now on
+void reset_peak_rss()
+{
+    std::ofstream("/proc/self/clear_refs") << "5";
+}
+
+// Peak resident set size in KiB
+long peak_rss()
+{
+    std::ifstream proc("/proc/self/status");
+    std::string   line;
+    while (std::getline(proc, line))
+        if (line.starts_with("VmHWM:"))
+            return std::stol(line.substr(6));
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+        return -1;
+
+    return usage.ru_maxrss;
+}
+
+// Measures the time, I/O calls and memory of one run
+class Probe
+{
+public:
+    Probe()
+    {
+        reset_peak_rss();
+        m_syscalls = io_syscalls();
+        m_start    = std::chrono::steady_clock::now();
+    }
+
+    void stop(Result& result)
+    {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - m_start;
+
+        result.seconds  = elapsed.count();
+        result.syscalls = io_syscalls() - m_syscalls;
+        result.peak_rss = peak_rss();
+    }
+
+private:
+    std::uint64_t                         m_syscalls;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+void fill(std::vector<char>& data, std::size_t seed)
+{
+    for (std::size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<char>(i * 31 + seed);
+}
+
+bool write_file(const fs::path& path, const std::vector<char>& data, std::size_t size)
+{
+    std::ofstream out(path, std::ios::binary);
+    out.write(data.data(), size);
+
+    return static_cast<bool>(out);
+}
+
+// Many files of up to 1 KiB, 100 per directory
+bool create_tiny(const fs::path& root, std::size_t count)
+{
+    std::vector<char> data(1024);
+    fill(data, 7);
+
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        fs::path dir = root / ("dir" + std::to_string(i / 100));
+        if (i % 100 == 0)
+            fs::create_directories(dir);
+
+        if (!write_file(dir / ("file" + std::to_string(i)), data, i * 37 % data.size()))
+            return false;
+    }
+
+    return true;
+}
+
+// A few big files that add up to total_mib MiB
+bool create_huge(const fs::path& root, std::size_t total_mib, std::size_t files)
+{
+    fs::create_directories(root);
+
+    std::vector<char> chunk(1 << 20);
+    fill(chunk, 7);
+
+    for (std::size_t i = 0; i < files; ++i)
+    {
+        std::ofstream out(root / ("file" + std::to_string(i)), std::ios::binary);
+        for (std::size_t mib = 0; mib < total_mib / files; ++mib)
+        {
+            chunk[0] = static_cast<char>(mib);
+            out.write(chunk.data(), chunk.size());
+        }
+
+        if (!out)
+            return false;
+    }
+
+    return true;
+}
+
+// Files whose paths are longer than the 100 bytes of the name field, so
+// that every one of them needs a @LongName entry
+bool create_deep(const fs::path& root, std::size_t count)
+{
+    std::vector<char> data(4096);
+    fill(data, 11);
+
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        fs::path dir = root;
+        for (std::size_t level = 0; level < 4; ++level)
+            dir /= "a_directory_with_a_rather_long_name_" + std::to_string((i / 50 + level) % 10);
+        fs::create_directories(dir);
+
+        if (!write_file(dir / ("file_with_a_long_name_as_well_" + std::to_string(i)), data, i * 53 % data.size()))
+            return false;
+    }
+
+    return true;
+}
+
+// Regular files, hard links, symbolic links, FIFOs and empty directories
+bool create_mixed(const fs::path& root, std::size_t count)
+{
+    std::vector<char> data(8192);
+    fill(data, 13);
+
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        fs::path dir = root / ("dir" + std::to_string(i / 100));
+        if (i % 100 == 0)
+            fs::create_directories(dir);
+
+        std::string name = std::to_string(i);
+        if (!write_file(dir / ("file" + name), data, i * 97 % data.size()))
+            return false;
+
+        std::error_code error;
+        fs::create_hard_link(dir / ("file" + name), dir / ("link" + name), error);
+        fs::create_symlink("file" + name, dir / ("symlink" + name), error);
+        fs::create_directory(dir / ("empty" + name), error);
+        if (error || mkfifo((dir / ("fifo" + name)).c_str(), 0644) < 0)
+            return false;
+    }
+
+    return true;
+}
+
+// A file of size_gib GiB with 1 MiB of data at the start of every GiB and
+// holes in between, and one of the same size with nothing but holes.
+// Returns false if the file system fills the holes in, since then there is
+// nothing to measure.
+bool create_sparse(const fs::path& root, std::size_t size_gib)
+{
+    fs::create_directories(root);
+
+    std::vector<char> chunk(1 << 20);
+    fill(chunk, 17);
+
+    fs::path      file = root / "file";
+    std::ofstream out(file, std::ios::binary);
+    for (std::size_t gib = 0; gib < size_gib; ++gib)
+    {
+        out.seekp(static_cast<std::streamoff>(gib) << 30);
+        out.write(chunk.data(), chunk.size());
+    }
+    out.close();
+    if (!out)
+        return false;
+    fs::resize_file(file, static_cast<std::uintmax_t>(size_gib) << 30);
+
+    fs::path holes = root / "holes";
+    std::ofstream(holes).close();
+    fs::resize_file(holes, static_cast<std::uintmax_t>(size_gib) << 30);
+
+    struct stat st;
+
+    return stat(file.c_str(), &st) == 0 && static_cast<std::uintmax_t>(st.st_blocks) * 512 < fs::file_size(file) / 2;
+}
+
+std::uint64_t count_entries(const fs::path& root)
+{
+    std::uint64_t count = 1;
+    for (auto it = fs::recursive_directory_iterator(root); it != fs::recursive_directory_iterator(); ++it)
+        count++;
+
+    return count;
+}
+
+Result run_archive(const fs::path& tree, const fs::path& archive, bool sparse = false)
+{
+    Result result;
+    result.files = count_entries(tree);
+
+    Probe         probe;
+    TAR::Archiver archiver(1, false, TAR::Format::GNU, sparse);
+    if (archiver.archive(tree, archive) != TAR::Status::OK)
+        throw std::runtime_error("could not archive " + tree.string());
+    probe.stop(result);
+
+    result.bytes = fs::file_size(archive);
+
+    return result;
+}
+
+Result run_list(const fs::path& archive, std::uint32_t threads = 1)
+{
+    Result result;
+    Probe  probe;
+    {
+        TAR::InStream        in(archive);
+        TAR::Parser          parser(in);
+        std::list<TAR::File> files;
+        if (parser.list_files(files, nullptr, threads) != TAR::Status::OK)
+            throw std::runtime_error("could not list " + archive.string());
+        result.files = files.size();
+    }
+    probe.stop(result);
+
+    result.bytes = fs::file_size(archive);
+
+    return result;
+}
+
+Result run_list_members(const fs::path& archive)
+{
+    Result result;
+    Probe  probe;
+    {
+        TAR::InStream in(archive);
+        TAR::Parser   parser(in);
+        TAR::Listing  listing;
+        if (parser.list_members(listing) != TAR::Status::OK)
+            throw std::runtime_error("could not list " + archive.string());
+        result.files = listing.members.size();
+    }
+    probe.stop(result);
+
+    result.bytes = fs::file_size(archive);
+
+    return result;
+}
+
+// Read the data of every regular file in a single pass
+Result run_read(const fs::path& archive)
+{
+    Result result;
+    Probe  probe;
+    {
+        TAR::InStream in(archive);
+        TAR::Parser   parser(in);
+        TAR::File     file;
+        TAR::Status   st;
+        while ((st = parser.next_file(file)) == TAR::Status::OK)
+        {
+            result.files++;
+            if (file.header.typeflag == '0' || file.header.typeflag == '\0')
+            {
+                TAR::View data = parser.read_file(file);
+                if (data.size() != file.header.size_in_bytes())
+                    throw std::runtime_error("could not read " + file.name);
+                result.bytes += data.size();
+            }
+            else if (in.skip_blocks(file.header.size_in_blocks()) != TAR::Status::OK)
+                throw std::runtime_error("could not skip " + file.name);
+        }
+
+        if (st != TAR::Status::END)
+            throw std::runtime_error("could not read " + archive.string());
+    }
+    probe.stop(result);
+
+    return result;
+}
+
+Result run_extract(const fs::path& archive, const fs::path& dest)
+{
+    Result result;
+    Probe  probe;
+    {
+        TAR::InStream in(archive);
+        TAR::Parser   parser(in);
+        if (parser.extract_all(dest) != TAR::Status::OK)
+            throw std::runtime_error("could not extract " + archive.string());
+    }
+    probe.stop(result);
+
+    result.files = count_entries(dest);
+    result.bytes = fs::file_size(archive);
+
+    return result;
+}
+
+// Sparse files are not hashed, so a manifest of a tree that only has sparse
+// files stays empty, also for files that are all holes
+void check_sparse_manifest(const fs::path& tree, const fs::path& archive)
+{
+    TAR::Archiver archiver(1, false, TAR::Format::GNU, true, false, TAR::Matcher(), TAR::Digest::NONE, TAR::Digest::SHA256);
+    if (archiver.archive(tree, archive) != TAR::Status::OK)
+        throw std::runtime_error("could not archive " + tree.string());
+    if (!archiver.digests().empty())
+        throw std::runtime_error("the manifest of " + archive.string() + " has sparse members in it");
+}
+
+// Push total_mib MiB of blocks through OutStream::write_blocks, 64 at a time
+Result run_write_blocks(const fs::path& archive, std::size_t total_mib)
+{
+    std::vector<TAR::Block> blocks(64);
+    for (std::size_t i = 0; i < blocks.size(); ++i)
+        std::memset(blocks[i].as_data, static_cast<int>(i), TAR::BLOCK_SIZE);
+
+    Result result;
+    Probe  probe;
+    {
+        TAR::OutStream out(archive);
+        std::uint64_t  count = (total_mib << 20) / (blocks.size() * TAR::BLOCK_SIZE);
+        for (std::uint64_t i = 0; i < count; ++i)
+            if (out.write_blocks(blocks) != TAR::Status::OK)
+                throw std::runtime_error("could not write " + archive.string());
+        if (out.close() != TAR::Status::OK)
+            throw std::runtime_error("could not write " + archive.string());
+        result.bytes = count * blocks.size() * TAR::BLOCK_SIZE;
+    }
+    probe.stop(result);
+
+    return result;
+}
+
+void print(const Result& result)
+{
+    std::cout << std::left << std::setw(8) << result.scenario << std::setw(14) << result.path << std::right
+              << std::fixed << std::setprecision(3)
+              << std::setw(10) << result.seconds << " s"
+              << std::setw(12) << std::setprecision(0) << result.files_per_second() << " files/s"
+              << std::setw(9) << std::setprecision(1) << result.mib_per_second() << " MiB/s"
+              << std::setw(10) << result.syscalls << " syscalls"
+              << std::setw(9) << result.peak_rss << " KiB peak RSS\n";
+}
+
+void write_json(const fs::path& path, const std::vector<Result>& results)
+{
+    std::ofstream out(path);
+    out << "{\n  \"results\": [\n";
+    for (std::size_t i = 0; i < results.size(); ++i)
+    {
+        const Result& r = results[i];
+        out << "    {\"scenario\": \"" << r.scenario << "\", \"path\": \"" << r.path
+            << "\", \"files\": " << r.files << ", \"bytes\": " << r.bytes
+            << ", \"seconds\": " << r.seconds << ", \"files_per_s\": " << r.files_per_second()
+            << ", \"mib_per_s\": " << r.mib_per_second() << ", \"syscalls\": " << r.syscalls
+            << ", \"peak_rss_kib\": " << r.peak_rss << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+// The value of "key" in a line written by write_json
+std::string json_field(const std::string& line, const std::string& key)
+{
+    auto start = line.find("\"" + key + "\": ");
+    if (start == std::string::npos)
+        return {};
+
+    start += key.size() + 4;
+    if (line[start] == '"')
+        return line.substr(start + 1, line.find('"', start + 1) - start - 1);
+
+    return line.substr(start, line.find_first_of(",}", start) - start);
+}
+
+// Only reads files written by write_json
+std::map<std::string, Result> read_json(const fs::path& path)
+{
+    std::ifstream                 in(path);
+    std::string                   line;
+    std::map<std::string, Result> results;
+    while (std::getline(in, line))
+    {
+        if (line.find("\"scenario\"") == std::string::npos)
+            continue;
+
+        Result r;
+        r.scenario = json_field(line, "scenario");
+        r.path     = json_field(line, "path");
+        r.files    = std::stoull(json_field(line, "files"));
+        r.bytes    = std::stoull(json_field(line, "bytes"));
+        r.seconds  = std::stod(json_field(line, "seconds"));
+        r.syscalls = std::stoull(json_field(line, "syscalls"));
+        r.peak_rss = std::stol(json_field(line, "peak_rss_kib"));
+
+        results[r.scenario + "/" + r.path] = r;
+    }
+
+    return results;
+}
+
+// Print the change of every metric and count the ones that got worse by
+// more than tolerance percent
+std::size_t compare(const std::vector<Result>& results, const std::map<std::string, Result>& baseline, double tolerance)
+{
+    std::size_t regressions = 0;
+    auto        change      = [](double now, double before)
+    { return before > 0 ? (now - before) / before * 100 : 0; };
+
+    std::cout << "\nCompared to the baseline(tolerance " << tolerance << "%):\n";
+    for (const auto& result : results)
+    {
+        auto it = baseline.find(result.scenario + "/" + result.path);
+        if (it == baseline.end())
+            continue;
+
+        const Result& before = it->second;
+        double        files  = change(result.files_per_second(), before.files_per_second());
+        double        mib    = change(result.mib_per_second(), before.mib_per_second());
+        double        calls  = change(result.syscalls, before.syscalls);
+        double        rss    = change(result.peak_rss, before.peak_rss);
+
+        // Throughput has to stay up, calls and memory have to stay down
+        bool worse = -files > tolerance || -mib > tolerance || calls > tolerance || rss > tolerance;
+        if (worse)
+            regressions++;
+
+        std::cout << std::left << std::setw(8) << result.scenario << std::setw(14) << result.path << std::right
+                  << std::showpos << std::setprecision(1)
+                  << std::setw(9) << files << "% files/s"
+                  << std::setw(9) << mib << "% MiB/s"
+                  << std::setw(9) << calls << "% syscalls"
+                  << std::setw(9) << rss << "% peak RSS" << std::noshowpos
+                  << (worse ? "  REGRESSION\n" : "\n");
+    }
+
+    return regressions;
+}
+
+int usage()
+{
+    std::cerr << "Usage: bench [--json output] [--baseline baseline] [--tolerance percent] [--scenario name]...\n"
+                 "             [work_directory] [size_in_MiB]\n"
+                 "Scenarios: tiny, huge, deep, mixed, sparse, blocks\n";
+    return 1;
+}
+}
+
+int main(int argc, char** argv)
+{
+    fs::path                 json, baseline;
+    double                   tolerance = 10;
+    std::vector<std::string> scenarios;
+    std::vector<std::string> positional;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!std::strcmp(argv[i], "--json") && i + 1 < argc)
+            json = argv[++i];
+        else if (!std::strcmp(argv[i], "--baseline") && i + 1 < argc)
+            baseline = argv[++i];
+        else if (!std::strcmp(argv[i], "--tolerance") && i + 1 < argc)
+            tolerance = std::stod(argv[++i]);
+        else if (!std::strcmp(argv[i], "--scenario") && i + 1 < argc)
+            scenarios.push_back(argv[++i]);
+        else if (argv[i][0] == '-')
+            return usage();
+        else
+            positional.push_back(argv[i]);
+    }
+
+    if (positional.size() > 2)
+        return usage();
+
+    fs::path    parent    = positional.size() > 0 ? fs::path(positional[0]) : fs::temp_directory_path();
+    std::size_t total_mib = positional.size() > 1 ? std::stoul(positional[1]) : 1024;
+    auto        selected  = [&scenarios](const std::string& name)
+    { return scenarios.empty() || std::find(scenarios.begin(), scenarios.end(), name) != scenarios.end(); };
+
+    typedef bool (*Generator)(const fs::path&);
+    const std::vector<std::pair<std::string, Generator>> trees = {
+        { "tiny", [](const fs::path& root) { return create_tiny(root, 20000); } },
+        { "deep", [](const fs::path& root) { return create_deep(root, 5000); } },
+        { "mixed", [](const fs::path& root) { return create_mixed(root, 2000); } },
+    };
+
+    std::vector<Result> results;
+    auto                add = [&results](Result result, const std::string& scenario, const std::string& path)
+    {
+        result.scenario = scenario;
+        result.path     = path;
+        print(result);
+        results.push_back(result);
+    };
+
+    // Everything goes in a directory of our own below the one given, which is
+    // the only thing removed at the end
+    fs::path work_dir;
+    try
+    {
+        fs::create_directories(parent);
+        std::string name = (parent / "tar-tools-bench.XXXXXX").string();
+        if (!mkdtemp(name.data()))
+            throw std::runtime_error("could not create a directory in " + parent.string());
+        work_dir = name;
+
+        for (const auto& [name, generator] : trees)
+        {
+            if (!selected(name))
+                continue;
+
+            fs::path tree    = work_dir / name;
+            fs::path archive = work_dir / (name + ".tar");
+            if (!generator(tree))
+                throw std::runtime_error("could not create " + tree.string());
+
+            add(run_archive(tree, archive), name, "archive");
+            add(run_list(archive), name, "list");
+            add(run_list_members(archive), name, "list_members");
+            add(run_list(archive, 0), name, "scan");
+            add(run_read(archive), name, "read");
+            fs::remove_all(tree);
+            fs::remove(archive);
+        }
+
+        if (selected("huge"))
+        {
+            fs::path tree    = work_dir / "huge";
+            fs::path archive = work_dir / "huge.tar";
+            if (!create_huge(tree, total_mib, 4))
+                throw std::runtime_error("could not create " + tree.string());
+
+            add(run_archive(tree, archive), "huge", "archive");
+            add(run_list(archive), "huge", "list");
+            add(run_list(archive, 0), "huge", "scan");
+            add(run_read(archive), "huge", "read");
+            fs::remove_all(tree);
+            fs::remove(archive);
+        }
+
+        // 100 GiB that are mostly holes, without hole detection the archive
+        // would have all of the zeros in it
+        if (selected("sparse"))
+        {
+            fs::path tree    = work_dir / "sparse";
+            fs::path archive = work_dir / "sparse.tar";
+            fs::path dest    = work_dir / "sparse.out";
+            if (!create_sparse(tree, 100))
+                std::cerr << "Skipping sparse, the file system does not keep holes\n";
+            else
+            {
+                add(run_archive(tree, archive, true), "sparse", "archive");
+                add(run_list(archive), "sparse", "list");
+                add(run_extract(archive, dest), "sparse", "extract");
+                check_sparse_manifest(tree, archive);
+                fs::remove_all(dest);
+                fs::remove(archive);
+            }
+            fs::remove_all(tree);
+        }
+
+        if (selected("blocks"))
+        {
+            fs::path archive = work_dir / "blocks.tar";
+            add(run_write_blocks(archive, total_mib), "blocks", "write_blocks");
+            fs::remove(archive);
+        }
+    }
+    catch (const std::exception& error)
+    {
+        std::cerr << "Error: " << error.what() << '\n';
+        if (!work_dir.empty())
+            fs::remove_all(work_dir);
+        return 1;
+    }
+
+    fs::remove_all(work_dir);
+
+    if (!json.empty())
+        write_json(json, results);
+
+    if (!baseline.empty())
+    {
+        if (!fs::exists(baseline))
+        {
+            std::cerr << "Error: " << baseline << " does not exist!\n";
+            return 1;
+        }
+
+        if (compare(results, read_json(baseline), tolerance))
+            return 1;
+    }
+
+    return 0;
+}
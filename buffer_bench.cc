@@ -0,0 +1,111 @@
+#include "tarstream.hh"
+#include <chrono>
+#include <iostream>
+#include <string>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+// Create a single file of size_mib MiB in its own directory
+bool create_tree(const fs::path& root, std::size_t size_mib)
+{
+    fs::create_directories(root);
+
+    std::vector<char> chunk(1 << 20);
+    for (std::size_t i = 0; i < chunk.size(); ++i)
+        chunk[i] = static_cast<char>(i * 31 + 7);
+
+    std::ofstream out(root / "file", std::ios::binary);
+    for (std::size_t mib = 0; mib < size_mib; ++mib)
+    {
+        chunk[0] = static_cast<char>(mib);
+        out.write(chunk.data(), chunk.size());
+    }
+
+    return static_cast<bool>(out);
+}
+
+// Walk every block of the archive, returns the seconds it took or a
+// negative value on errors
+double read_archive(const fs::path& archive, TAR::Backend backend, std::size_t buffer_size)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    TAR::InStream     in(archive, 20, backend, buffer_size);
+    const TAR::Block* block;
+    TAR::Status       st;
+    std::uint64_t     blocks = 0;
+    while ((st = in.view_block(block)) == TAR::Status::OK)
+        blocks++;
+
+    if (st != TAR::Status::END || !blocks)
+        return -1;
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    return elapsed.count();
+}
+
+double write_archive(const fs::path& tree, const fs::path& archive, std::size_t buffer_size, bool direct)
+{
+    auto start = std::chrono::steady_clock::now();
+    {
+        TAR::Archiver  archiver;
+        TAR::OutStream out(archive, 20, TAR::Codec::NONE, 1, TAR::Backend::STREAM, buffer_size, direct);
+        if (archiver.archive(tree, out) != TAR::Status::OK)
+            return -1;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    return elapsed.count();
+}
+
+void report(const char* what, std::size_t size_mib, double seconds)
+{
+    if (seconds < 0)
+        std::cout << "  " << what << ": error";
+    else
+        std::cout << "  " << what << ": " << size_mib / seconds << " MiB/s";
+}
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 3)
+    {
+        std::cerr << "Usage: buffer_bench [work_directory] [size_in_MiB]\n";
+        return 1;
+    }
+
+    fs::path    work_dir = argc > 1 ? argv[1] : fs::temp_directory_path() / "tar-tools-buffer-bench";
+    std::size_t size_mib = argc > 2 ? std::stoul(argv[2]) : 1024;
+    fs::path    tree     = work_dir / "tree";
+    fs::path    archive  = work_dir / "tree.tar";
+
+    if (!create_tree(tree, size_mib))
+    {
+        std::cerr << "Error: could not create " << tree << '\n';
+        return 1;
+    }
+
+    // Reads come from the page cache, so they show the per call overhead.
+    // O_DIRECT writes take every byte through the buffer.
+    for (std::size_t buffer_size : { 10240ul, 65536ul, 262144ul, 1048576ul, 4194304ul, 16777216ul })
+    {
+        double direct = write_archive(tree, archive, buffer_size, true);
+        double stream = read_archive(archive, TAR::Backend::STREAM, buffer_size);
+        double uring  = read_archive(archive, TAR::Backend::URING, buffer_size);
+
+        std::cout << buffer_size / 1024 << " KiB:";
+        report("O_DIRECT write", size_mib, direct);
+        report("read", size_mib, stream);
+        report("io_uring read", size_mib, uring);
+        std::cout << '\n';
+    }
+
+    fs::remove_all(work_dir);
+
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include "tarstream.hh"
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+
+namespace
+{
+// The byte by byte versions the kernels replaced, kept as the baseline
+std::uint32_t checksum_reference(const TAR::Block& block)
+{
+    std::uint32_t       sum         = 0;
+    const std::uint8_t* chksum      = reinterpret_cast<const uint8_t*>(block.as_header.chksum);
+    auto                end_address = chksum + sizeof(block.as_header.chksum);
+
+    for (std::uint16_t i = 0; i < TAR::BLOCK_SIZE; ++i)
+    {
+        if (&block.as_data[i] >= chksum && &block.as_data[i] < end_address)
+            sum += 0x20;
+        else
+            sum += block.as_data[i];
+    }
+
+    return sum;
+}
+
+bool is_zero_reference(const TAR::Block& block)
+{
+    for (std::uint16_t i = 0; i < TAR::BLOCK_SIZE; ++i)
+        if (block.as_data[i])
+            return false;
+
+    return true;
+}
+
+// Headers filled like the archiver fills them, with random contents
+std::vector<TAR::Block> create_headers(std::size_t count)
+{
+    std::vector<TAR::Block>         blocks(count);
+    std::mt19937                    generator(42);
+    std::uniform_int_distribution<> byte(0, 255);
+
+    for (auto& block : blocks)
+    {
+        std::memset(&block, 0, sizeof(block));
+        for (std::uint32_t i = 0; i < TAR::BLOCK_SIZE; ++i)
+            if (byte(generator) < 160)
+                block.as_data[i] = byte(generator);
+    }
+
+    return blocks;
+}
+
+template <typename Function>
+double measure(const std::vector<TAR::Block>& blocks, std::uint32_t rounds, Function function)
+{
+    std::uint64_t sink  = 0;
+    auto          start = std::chrono::steady_clock::now();
+    for (std::uint32_t round = 0; round < rounds; ++round)
+        for (const auto& block : blocks)
+            sink += function(block);
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+    // Keep the compiler from dropping the loop
+    if (sink == 1)
+        std::cerr << '.';
+
+    return elapsed.count() / (static_cast<double>(blocks.size()) * rounds);
+}
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 2)
+    {
+        std::cerr << "Usage: checksum_bench [rounds]\n";
+        return 1;
+    }
+
+    std::uint32_t rounds  = argc > 1 ? std::stoul(argv[1]) : 200;
+    auto          headers = create_headers(4096);
+    auto          zeros   = std::vector<TAR::Block>(4096);
+    std::memset(zeros.data(), 0, zeros.size() * sizeof(TAR::Block));
+
+    // Blocks that are zero except for a single byte catch wrong lane handling
+    auto checked = headers;
+    for (std::uint32_t i = 0; i < TAR::BLOCK_SIZE; ++i)
+    {
+        checked.push_back(zeros.front());
+        checked.back().as_data[i] = 0xFF;
+    }
+    checked.push_back(zeros.front());
+
+    for (const auto& kernel : TAR::block_kernels())
+    {
+        for (const auto& block : checked)
+        {
+            if (kernel.checksum(block) != checksum_reference(block) || kernel.is_zero(block) != is_zero_reference(block))
+            {
+                std::cerr << "Error: the " << kernel.name << " kernel does not match the reference!\n";
+                return 1;
+            }
+        }
+    }
+
+    std::cout << "ns per block      checksum  is_zero(header)  is_zero(zeros)\n";
+    auto report = [&](const char* name, auto checksum, auto is_zero)
+    {
+        std::cout.width(16);
+        std::cout << std::left << name << std::right;
+        std::cout.width(10);
+        std::cout << measure(headers, rounds, checksum);
+        std::cout.width(17);
+        std::cout << measure(headers, rounds, is_zero);
+        std::cout.width(16);
+        std::cout << measure(zeros, rounds, is_zero) << '\n';
+    };
+
+    report("reference", checksum_reference, is_zero_reference);
+    for (const auto& kernel : TAR::block_kernels())
+        report(kernel.name, kernel.checksum, kernel.is_zero);
+
+    return 0;
+}
@@ -0,0 +1,386 @@
+#include "digest.hh"
+#include "stats.hh"
+#include <bit>
+#include <cstring>
+#include <fstream>
+#if defined(__x86_64__)
+#    include <immintrin.h>
+#endif
+
+namespace TAR
+{
+static const std::uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+constexpr std::size_t SHA256_BLOCK = 64;
+
+static void sha256_scalar(std::uint32_t state[8], const std::uint8_t* data, std::size_t blocks)
+{
+    for (; blocks; --blocks, data += SHA256_BLOCK)
+    {
+        std::uint32_t w[64];
+        for (std::size_t i = 0; i < 16; ++i)
+            w[i] = std::uint32_t(data[4 * i]) << 24 | std::uint32_t(data[4 * i + 1]) << 16
+                | std::uint32_t(data[4 * i + 2]) << 8 | data[4 * i + 3];
+        for (std::size_t i = 16; i < 64; ++i)
+        {
+            std::uint32_t s0 = std::rotr(w[i - 15], 7) ^ std::rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            std::uint32_t s1 = std::rotr(w[i - 2], 17) ^ std::rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i]             = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        std::uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        std::uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (std::size_t i = 0; i < 64; ++i)
+        {
+            std::uint32_t s1    = std::rotr(e, 6) ^ std::rotr(e, 11) ^ std::rotr(e, 25);
+            std::uint32_t ch    = (e & f) ^ (~e & g);
+            std::uint32_t temp1 = h + s1 + ch + SHA256_K[i] + w[i];
+            std::uint32_t s0    = std::rotr(a, 2) ^ std::rotr(a, 13) ^ std::rotr(a, 22);
+            std::uint32_t maj   = (a & b) ^ (a & c) ^ (b & c);
+            std::uint32_t temp2 = s0 + maj;
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + temp1;
+            d = c;
+            c = b;
+            b = a;
+            a = temp1 + temp2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__x86_64__)
+// With the SHA extensions, two rounds per instruction. The state is kept as
+// ABEF and CDGH, the order sha256rnds2 works on.
+__attribute__((target("sha,sse4.1"))) static void sha256_shani(std::uint32_t state[8], const std::uint8_t* data, std::size_t blocks)
+{
+    const __m128i mask  = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i       cdab  = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0xB1);
+    __m128i       efgh  = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4)), 0x1B);
+    __m128i       abef  = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i       cdgh  = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+    for (; blocks; --blocks, data += SHA256_BLOCK)
+    {
+        __m128i abef_start = abef;
+        __m128i cdgh_start = cdgh;
+        __m128i w[4];
+
+        // Four rounds at a time, the schedule is kept for the last 16 words
+        for (std::size_t i = 0; i < 16; ++i)
+        {
+            __m128i words;
+            if (i < 4)
+                words = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data) + i), mask);
+            else
+            {
+                words = _mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]);
+                words = _mm_add_epi32(words, _mm_alignr_epi8(w[(i + 3) % 4], w[(i + 2) % 4], 4));
+                words = _mm_sha256msg2_epu32(words, w[(i + 3) % 4]);
+            }
+            w[i % 4] = words;
+
+            __m128i message = _mm_add_epi32(words, _mm_loadu_si128(reinterpret_cast<const __m128i*>(SHA256_K) + i));
+            cdgh            = _mm_sha256rnds2_epu32(cdgh, abef, message);
+            abef            = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(message, 0x0E));
+        }
+
+        abef = _mm_add_epi32(abef, abef_start);
+        cdgh = _mm_add_epi32(cdgh, cdgh_start);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), _mm_alignr_epi8(dchg, feba, 8));
+}
+#endif
+
+typedef void (*Sha256Kernel)(std::uint32_t state[8], const std::uint8_t* data, std::size_t blocks);
+
+// Resolved once, like the block kernels
+static const Sha256Kernel sha256_blocks = []()
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+        return sha256_shani;
+#endif
+    return sha256_scalar;
+}();
+
+static std::string to_hex(const std::uint8_t* bytes, std::size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string       hex(2 * size, '0');
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        hex[2 * i]     = digits[bytes[i] >> 4];
+        hex[2 * i + 1] = digits[bytes[i] & 0xf];
+    }
+
+    return hex;
+}
+
+class Sha256Hasher : public Hasher
+{
+public:
+    void update(View data) override
+    {
+        TAR_TIME(DIGEST);
+        m_length += data.size();
+        if (m_buffered)
+        {
+            std::size_t take = std::min(SHA256_BLOCK - m_buffered, data.size());
+            std::memcpy(m_buffer + m_buffered, data.data(), take);
+            m_buffered += take;
+            data = data.subspan(take);
+            if (m_buffered < SHA256_BLOCK)
+                return;
+            sha256_blocks(m_state, m_buffer, 1);
+            m_buffered = 0;
+        }
+
+        std::size_t blocks = data.size() / SHA256_BLOCK;
+        if (blocks)
+            sha256_blocks(m_state, data.data(), blocks);
+
+        m_buffered = data.size() % SHA256_BLOCK;
+        std::memcpy(m_buffer, data.data() + blocks * SHA256_BLOCK, m_buffered);
+    }
+
+    std::string finish() override
+    {
+        // A 1 bit, zeros up to 8 bytes before the end of a block, then the
+        // length in bits
+        std::uint64_t bits = m_length * 8;
+        std::uint8_t  padding[SHA256_BLOCK + 8];
+        std::size_t   size = (m_buffered < 56 ? 56 : 120) - m_buffered;
+        std::memset(padding, 0, sizeof(padding));
+        padding[0] = 0x80;
+        for (std::size_t i = 0; i < 8; ++i)
+            padding[size + i] = bits >> (56 - 8 * i);
+        update(View(padding, size + 8));
+
+        std::uint8_t digest[32];
+        for (std::size_t i = 0; i < 8; ++i)
+            for (std::size_t j = 0; j < 4; ++j)
+                digest[4 * i + j] = m_state[i] >> (24 - 8 * j);
+
+        return to_hex(digest, sizeof(digest));
+    }
+
+private:
+    std::uint32_t m_state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    std::uint64_t m_length   = 0;
+    std::uint8_t  m_buffer[SHA256_BLOCK];
+    std::size_t   m_buffered = 0;
+};
+
+constexpr std::uint64_t XXH_PRIME1 = 0x9E3779B185EBCA87ULL;
+constexpr std::uint64_t XXH_PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr std::uint64_t XXH_PRIME3 = 0x165667B19E3779F9ULL;
+constexpr std::uint64_t XXH_PRIME4 = 0x85EBCA77C2B2AE63ULL;
+constexpr std::uint64_t XXH_PRIME5 = 0x27D4EB2F165667C5ULL;
+
+static std::uint64_t read64(const std::uint8_t* data)
+{
+    std::uint64_t value;
+    std::memcpy(&value, data, sizeof(value));
+
+    return value;
+}
+
+static std::uint64_t xxh_round(std::uint64_t acc, std::uint64_t input)
+{
+    return std::rotl(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+static std::uint64_t xxh_merge(std::uint64_t acc, std::uint64_t value)
+{
+    return (acc ^ xxh_round(0, value)) * XXH_PRIME1 + XXH_PRIME4;
+}
+
+// XXH64 with seed 0, little endian hosts only
+class Xxh64Hasher : public Hasher
+{
+public:
+    void update(View data) override
+    {
+        TAR_TIME(DIGEST);
+        m_length += data.size();
+        if (m_buffered)
+        {
+            std::size_t take = std::min(sizeof(m_buffer) - m_buffered, data.size());
+            std::memcpy(m_buffer + m_buffered, data.data(), take);
+            m_buffered += take;
+            data = data.subspan(take);
+            if (m_buffered < sizeof(m_buffer))
+                return;
+            stripes(m_buffer, 1);
+            m_buffered = 0;
+        }
+
+        std::size_t count = data.size() / sizeof(m_buffer);
+        stripes(data.data(), count);
+
+        m_buffered = data.size() % sizeof(m_buffer);
+        std::memcpy(m_buffer, data.data() + count * sizeof(m_buffer), m_buffered);
+    }
+
+    std::string finish() override
+    {
+        std::uint64_t hash;
+        if (m_length >= sizeof(m_buffer))
+        {
+            hash = std::rotl(m_acc[0], 1) + std::rotl(m_acc[1], 7) + std::rotl(m_acc[2], 12) + std::rotl(m_acc[3], 18);
+            for (std::uint64_t acc : m_acc)
+                hash = xxh_merge(hash, acc);
+        }
+        else
+            hash = XXH_PRIME5;
+        hash += m_length;
+
+        const std::uint8_t* tail = m_buffer;
+        std::size_t         left = m_buffered;
+        for (; left >= 8; tail += 8, left -= 8)
+            hash = std::rotl(hash ^ xxh_round(0, read64(tail)), 27) * XXH_PRIME1 + XXH_PRIME4;
+        if (left >= 4)
+        {
+            std::uint32_t word;
+            std::memcpy(&word, tail, sizeof(word));
+            hash = std::rotl(hash ^ word * XXH_PRIME1, 23) * XXH_PRIME2 + XXH_PRIME3;
+            tail += 4;
+            left -= 4;
+        }
+        for (; left; ++tail, --left)
+            hash = std::rotl(hash ^ *tail * XXH_PRIME5, 11) * XXH_PRIME1;
+
+        hash ^= hash >> 33;
+        hash *= XXH_PRIME2;
+        hash ^= hash >> 29;
+        hash *= XXH_PRIME3;
+        hash ^= hash >> 32;
+
+        std::uint8_t digest[8];
+        for (std::size_t i = 0; i < 8; ++i)
+            digest[i] = hash >> (56 - 8 * i);
+
+        return to_hex(digest, sizeof(digest));
+    }
+
+private:
+    void stripes(const std::uint8_t* data, std::size_t count)
+    {
+        for (; count; --count, data += sizeof(m_buffer))
+            for (std::size_t lane = 0; lane < 4; ++lane)
+                m_acc[lane] = xxh_round(m_acc[lane], read64(data + 8 * lane));
+    }
+
+    std::uint64_t m_acc[4]   = { XXH_PRIME1 + XXH_PRIME2, XXH_PRIME2, 0, 0 - XXH_PRIME1 };
+    std::uint64_t m_length   = 0;
+    std::uint8_t  m_buffer[32];
+    std::size_t   m_buffered = 0;
+};
+
+std::unique_ptr<Hasher> make_hasher(Digest digest)
+{
+    switch (digest)
+    {
+    case Digest::SHA256:
+        return std::make_unique<Sha256Hasher>();
+    case Digest::XXH64:
+        return std::make_unique<Xxh64Hasher>();
+    default:
+        return nullptr;
+    }
+}
+
+Digest parse_digest(std::string_view name)
+{
+    if (name == "sha256")
+        return Digest::SHA256;
+    if (name == "xxh64")
+        return Digest::XXH64;
+
+    return Digest::NONE;
+}
+
+const char* digest_name(Digest digest)
+{
+    switch (digest)
+    {
+    case Digest::SHA256:
+        return "sha256";
+    case Digest::XXH64:
+        return "xxh64";
+    default:
+        return "none";
+    }
+}
+
+std::string digest_keyword(Digest digest)
+{
+    return std::string("TARTOOLS.") + digest_name(digest);
+}
+
+Status read_manifest(const fs::path& path, Manifest& manifest)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        std::cerr << "Could not open " << path << '\n';
+        return Status::ERROR;
+    }
+
+    // sha256sum marks binary mode with * in front of the name
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::size_t space = line.find(' ');
+        if (space == std::string::npos || space + 2 > line.size())
+        {
+            std::cerr << "Malformed line in " << path << ": " << line << '\n';
+            return Status::ERROR;
+        }
+        manifest[line.substr(space + 2)] = line.substr(0, space);
+    }
+
+    return Status::OK;
+}
+
+Status write_manifest(const fs::path& path, const std::vector<std::pair<std::string, std::string>>& digests)
+{
+    std::ofstream out(path);
+    for (const auto& [name, digest] : digests)
+        out << digest << "  " << name << '\n';
+    out.close();
+    if (!out)
+    {
+        std::cerr << "Could not write " << path << '\n';
+        return Status::ERROR;
+    }
+
+    return Status::OK;
+}
+}
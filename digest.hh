@@ -0,0 +1,37 @@
+#ifndef DIGEST_HH
+#define DIGEST_HH
+
+#include "tarstream.hh"
+
+namespace TAR
+{
+// Computes a digest of data that comes in pieces
+class Hasher
+{
+public:
+    virtual ~Hasher() = default;
+
+    virtual void update(View data) = 0;
+
+    // In lower case hex, as sha256sum and xxhsum print it. Nothing may be
+    // added after.
+    virtual std::string finish() = 0;
+};
+
+// Null for Digest::NONE
+std::unique_ptr<Hasher> make_hasher(Digest digest);
+
+// "sha256" or "xxh64", NONE for anything else
+Digest parse_digest(std::string_view name);
+
+const char* digest_name(Digest digest);
+
+// Digests are stored in PAX records under TARTOOLS.<name>
+std::string digest_keyword(Digest digest);
+
+// Lines of "digest  name" as sha256sum and xxhsum write them
+Status read_manifest(const fs::path& path, Manifest& manifest);
+
+Status write_manifest(const fs::path& path, const std::vector<std::pair<std::string, std::string>>& digests);
+}
+#endif // DIGEST_HH
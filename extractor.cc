@@ -0,0 +1,88 @@
+#include "tarstream.hh"
+#include "stats.hh"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+// Counters and timers are only there in builds with make STATS=1
+static void print_stats()
+{
+#ifdef TAR_STATS
+    TAR::print_stats(std::cerr);
+#else
+    std::cerr << "Statistics were not compiled in, rebuild with make STATS=1\n";
+#endif
+}
+
+int main(int argc, char** argv)
+{
+    TAR::Backend  backend     = TAR::Backend::STREAM;
+    std::uint32_t threads     = 1;
+    std::size_t   buffer_size = TAR::DEFAULT_BUFFER_SIZE;
+    bool          stats       = false;
+    TAR::Matcher  matcher;
+
+    // -j uses one writer thread per core, -jN uses N threads
+    while (argc > 1 && argv[1][0] == '-')
+    {
+        if (!std::strcmp(argv[1], "--mmap"))
+            backend = TAR::Backend::MMAP;
+        else if (!std::strcmp(argv[1], "--uring"))
+            backend = TAR::Backend::URING;
+        else if (!std::strcmp(argv[1], "--stats"))
+            stats = true;
+        else if (!std::strcmp(argv[1], "--buffer-size") && argc > 2)
+        {
+            buffer_size = std::stoul(argv[2]);
+            argv++;
+            argc--;
+        }
+        else if (!std::strcmp(argv[1], "--include") && argc > 2)
+        {
+            matcher.include(argv[2]);
+            argv++;
+            argc--;
+        }
+        else if (!std::strcmp(argv[1], "--exclude") && argc > 2)
+        {
+            matcher.exclude(argv[2]);
+            argv++;
+            argc--;
+        }
+        else if (std::string(argv[1]).starts_with("-j"))
+            threads = argv[1][2] ? std::stoul(argv[1] + 2) : std::max(1u, std::thread::hardware_concurrency());
+        else
+            break;
+        argv++;
+        argc--;
+    }
+
+    if (argc != 2 && argc != 3)
+    {
+        std::cerr << "Usage: extractor [--mmap|--uring] [--buffer-size bytes] [--include pattern]... [--exclude pattern]... [--stats] [-j[threads]] input.tar|- [output_directory]\n";
+        return 1;
+    }
+
+    if (buffer_size > TAR::MAX_BUFFER_SIZE)
+    {
+        std::cerr << "--buffer-size can be at most " << TAR::MAX_BUFFER_SIZE << " bytes\n";
+        return 1;
+    }
+
+    // - reads the archive from stdin, forward only
+    std::unique_ptr<TAR::InStream> in(std::strcmp(argv[1], "-") ? new TAR::InStream(argv[1], 20, backend, buffer_size)
+                                                                : new TAR::InStream(STDIN_FILENO, 20, buffer_size));
+    TAR::Parser                    parser(*in);
+    if (parser.extract_all(argc == 3 ? argv[2] : ".", threads, &matcher) != TAR::Status::OK)
+    {
+        std::cerr << "Error: could not extract!\n";
+        return 1;
+    }
+
+    if (stats)
+        print_stats();
+
+    return 0;
+}
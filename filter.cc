@@ -0,0 +1,522 @@
+#include "filter.hh"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef TAR_HAVE_ZLIB
+#    include <zlib.h>
+#endif
+#ifdef TAR_HAVE_ZSTD
+#    include <zstd.h>
+#endif
+
+namespace TAR
+{
+// Size of the buffers holding compressed bytes
+constexpr std::size_t FILTER_BUFFER = 128 * 1024;
+
+// Only the codecs move bytes through file descriptors themselves
+#if defined(TAR_HAVE_ZLIB) || defined(TAR_HAVE_ZSTD)
+static ssize_t read_some(int fd, std::uint8_t* data, std::size_t size)
+{
+    ssize_t bytes;
+    do
+        bytes = ::read(fd, data, size);
+    while (bytes < 0 && errno == EINTR);
+
+    return bytes;
+}
+
+static Status write_all(int fd, const std::uint8_t* data, std::size_t size)
+{
+    std::size_t done = 0;
+    while (done < size)
+    {
+        ssize_t bytes = ::write(fd, data + done, size - done);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return Status::ERROR;
+        done += bytes;
+    }
+
+    return Status::OK;
+}
+#endif
+
+// The zstd seekable format
+constexpr std::uint32_t SKIPPABLE_MAGIC   = 0x184D2A5E;
+constexpr std::uint32_t SEEKABLE_MAGIC    = 0x8F92EAB1;
+constexpr std::size_t   SEEK_TABLE_FOOTER = 9;
+
+static std::uint32_t get_le32(const std::uint8_t* data)
+{
+    return data[0] | data[1] << 8 | data[2] << 16 | static_cast<std::uint32_t>(data[3]) << 24;
+}
+
+#ifdef TAR_HAVE_ZLIB
+class GzipDecoder : public Decoder
+{
+public:
+    GzipDecoder(int fd, View buffered)
+        : m_fd(fd)
+        , m_input(std::max(FILTER_BUFFER, buffered.size()))
+        , m_member_end(false)
+    {
+        std::memset(&m_stream, 0, sizeof(m_stream));
+        // 32 lets zlib detect the gzip header
+        if (inflateInit2(&m_stream, 15 + 32) != Z_OK)
+            throw std::runtime_error("Could not initialize zlib");
+
+        std::copy(buffered.begin(), buffered.end(), m_input.begin());
+        m_stream.next_in  = m_input.data();
+        m_stream.avail_in = buffered.size();
+    }
+
+    ~GzipDecoder() { inflateEnd(&m_stream); }
+
+    ssize_t read(std::uint8_t* data, std::size_t size) override
+    {
+        m_stream.next_out  = data;
+        m_stream.avail_out = size;
+
+        while (m_stream.avail_out > 0)
+        {
+            if (!m_stream.avail_in)
+            {
+                ssize_t bytes = read_some(m_fd, m_input.data(), m_input.size());
+                if (bytes < 0)
+                    return -1;
+
+                // The input may only end between gzip members
+                if (!bytes)
+                {
+                    if (!m_member_end)
+                        return -1;
+                    break;
+                }
+
+                m_stream.next_in  = m_input.data();
+                m_stream.avail_in = bytes;
+            }
+
+            // Concatenated members(e.g. from pigz or appending) form one stream
+            if (m_member_end)
+            {
+                inflateReset(&m_stream);
+                m_member_end = false;
+            }
+
+            int ret = inflate(&m_stream, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END)
+                m_member_end = true;
+            else if (ret != Z_OK && ret != Z_BUF_ERROR)
+                return -1;
+        }
+
+        return size - m_stream.avail_out;
+    }
+
+    Status rewind(std::uint64_t offset) override
+    {
+        if (lseek(m_fd, offset, SEEK_SET) < 0 || inflateReset(&m_stream) != Z_OK)
+            return Status::ERROR;
+
+        m_stream.avail_in = 0;
+        m_member_end      = false;
+
+        return Status::OK;
+    }
+
+private:
+    int      m_fd;
+    z_stream m_stream;
+    Data     m_input;
+    bool     m_member_end;
+};
+
+class GzipEncoder : public Encoder
+{
+public:
+    GzipEncoder(int fd)
+        : m_fd(fd)
+        , m_output(FILTER_BUFFER)
+    {
+        std::memset(&m_stream, 0, sizeof(m_stream));
+        // 16 makes zlib write a gzip header and trailer
+        if (deflateInit2(&m_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("Could not initialize zlib");
+    }
+
+    ~GzipEncoder() { deflateEnd(&m_stream); }
+
+    Status write(const std::uint8_t* data, std::size_t size) override
+    {
+        m_stream.next_in  = const_cast<std::uint8_t*>(data);
+        m_stream.avail_in = size;
+
+        return deflate_all(Z_NO_FLUSH);
+    }
+
+    Status finish() override { return deflate_all(Z_FINISH); }
+
+private:
+    Status deflate_all(int flush)
+    {
+        int ret;
+        do
+        {
+            m_stream.next_out  = m_output.data();
+            m_stream.avail_out = m_output.size();
+
+            ret = deflate(&m_stream, flush);
+            if (ret == Z_STREAM_ERROR)
+                return Status::ERROR;
+
+            if (write_all(m_fd, m_output.data(), m_output.size() - m_stream.avail_out) != Status::OK)
+                return Status::ERROR;
+        } while (m_stream.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+        return Status::OK;
+    }
+
+    int      m_fd;
+    z_stream m_stream;
+    Data     m_output;
+};
+#endif
+
+#ifdef TAR_HAVE_ZSTD
+constexpr std::uint64_t FRAME_LIMIT = 64 * 1024 * 1024;
+
+static void put_le32(Data& data, std::uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        data.push_back(value >> (8 * i));
+}
+
+class ZstdDecoder : public Decoder
+{
+public:
+    ZstdDecoder(int fd, View buffered)
+        : m_fd(fd)
+        , m_context(ZSTD_createDCtx())
+        , m_input(std::max(FILTER_BUFFER, buffered.size()))
+        , m_in { m_input.data(), buffered.size(), 0 }
+        , m_frame_end(true)
+    {
+        if (!m_context)
+            throw std::runtime_error("Could not initialize zstd");
+
+        std::copy(buffered.begin(), buffered.end(), m_input.begin());
+    }
+
+    ~ZstdDecoder() { ZSTD_freeDCtx(m_context); }
+
+    ssize_t read(std::uint8_t* data, std::size_t size) override
+    {
+        ZSTD_outBuffer out { data, size, 0 };
+
+        while (out.pos < out.size)
+        {
+            if (m_in.pos == m_in.size)
+            {
+                ssize_t bytes = read_some(m_fd, m_input.data(), m_input.size());
+                if (bytes < 0)
+                    return -1;
+
+                // The input may only end between frames
+                if (!bytes)
+                {
+                    if (!m_frame_end)
+                        return -1;
+                    break;
+                }
+
+                m_in = { m_input.data(), static_cast<std::size_t>(bytes), 0 };
+            }
+
+            std::size_t ret = ZSTD_decompressStream(m_context, &out, &m_in);
+            if (ZSTD_isError(ret))
+                return -1;
+            m_frame_end = ret == 0;
+        }
+
+        return out.pos;
+    }
+
+    Status rewind(std::uint64_t offset) override
+    {
+        if (lseek(m_fd, offset, SEEK_SET) < 0 || ZSTD_isError(ZSTD_DCtx_reset(m_context, ZSTD_reset_session_only)))
+            return Status::ERROR;
+
+        m_in        = { m_input.data(), 0, 0 };
+        m_frame_end = true;
+
+        return Status::OK;
+    }
+
+private:
+    int           m_fd;
+    ZSTD_DCtx*    m_context;
+    Data          m_input;
+    ZSTD_inBuffer m_in;
+    bool          m_frame_end;
+};
+
+class ZstdEncoder : public Encoder
+{
+public:
+    ZstdEncoder(int fd, std::uint32_t threads, bool seekable)
+        : m_fd(fd)
+        , m_context(ZSTD_createCCtx())
+        , m_output(FILTER_BUFFER)
+        , m_seekable(seekable)
+        , m_frame_in(0)
+        , m_frame_out(0)
+    {
+        if (!m_context)
+            throw std::runtime_error("Could not initialize zstd");
+
+        // Fails if libzstd was built without threads, compression is then
+        // done on the calling thread
+        if (threads > 1 && ZSTD_isError(ZSTD_CCtx_setParameter(m_context, ZSTD_c_nbWorkers, threads)))
+            std::cerr << "zstd was built without multithreading support\n";
+    }
+
+    ~ZstdEncoder() { ZSTD_freeCCtx(m_context); }
+
+    Status write(const std::uint8_t* data, std::size_t size) override
+    {
+        // Frames of seekable archives are cut at FRAME_LIMIT even within a
+        // member, the sizes in the seek table have 32 bits
+        while (size > 0)
+        {
+            std::size_t   chunk = m_seekable ? std::min<std::uint64_t>(size, FRAME_LIMIT - m_frame_in) : size;
+            ZSTD_inBuffer in { data, chunk, 0 };
+            std::size_t   remaining;
+
+            while (in.pos < in.size)
+                if (compress(in, ZSTD_e_continue, remaining) != Status::OK)
+                    return Status::ERROR;
+
+            m_frame_in += chunk;
+            data += chunk;
+            size -= chunk;
+            if (m_seekable && m_frame_in == FRAME_LIMIT && end_frame() != Status::OK)
+                return Status::ERROR;
+        }
+
+        return Status::OK;
+    }
+
+    Status finish() override
+    {
+        if (!m_seekable)
+            return flush();
+
+        if (m_frame_in && end_frame() != Status::OK)
+            return Status::ERROR;
+
+        return write_seek_table();
+    }
+
+    Status end_frame() override
+    {
+        if (!m_seekable || !m_frame_in)
+            return Status::OK;
+
+        if (flush() != Status::OK)
+            return Status::ERROR;
+
+        m_frames.emplace_back(m_frame_out, m_frame_in);
+        m_frame_in  = 0;
+        m_frame_out = 0;
+
+        return Status::OK;
+    }
+
+    std::uint64_t frame_size() const override { return m_frame_in; }
+
+private:
+    // End the zstd frame and write all of it
+    Status flush()
+    {
+        ZSTD_inBuffer in { nullptr, 0, 0 };
+        std::size_t   remaining;
+
+        do
+            if (compress(in, ZSTD_e_end, remaining) != Status::OK)
+                return Status::ERROR;
+        while (remaining);
+
+        return Status::OK;
+    }
+
+    // remaining is what zstd still has to flush
+    Status compress(ZSTD_inBuffer& in, ZSTD_EndDirective directive, std::size_t& remaining)
+    {
+        ZSTD_outBuffer out { m_output.data(), m_output.size(), 0 };
+        remaining = ZSTD_compressStream2(m_context, &out, &in, directive);
+        if (ZSTD_isError(remaining))
+            return Status::ERROR;
+        m_frame_out += out.pos;
+
+        return write_all(m_fd, m_output.data(), out.pos);
+    }
+
+    // A skippable frame with the compressed and decompressed size of every
+    // frame, then the number of frames, a descriptor without checksums and
+    // the seekable magic number
+    Status write_seek_table()
+    {
+        Data table;
+        put_le32(table, SKIPPABLE_MAGIC);
+        put_le32(table, m_frames.size() * 8 + SEEK_TABLE_FOOTER);
+        for (const auto& [compressed, uncompressed] : m_frames)
+        {
+            put_le32(table, compressed);
+            put_le32(table, uncompressed);
+        }
+        put_le32(table, m_frames.size());
+        table.push_back(0);
+        put_le32(table, SEEKABLE_MAGIC);
+
+        return write_all(m_fd, table.data(), table.size());
+    }
+
+    int                m_fd;
+    ZSTD_CCtx*         m_context;
+    Data               m_output;
+    bool               m_seekable;
+    std::uint64_t      m_frame_in;  // bytes given to the current frame
+    std::uint64_t      m_frame_out; // bytes it compressed to so far
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> m_frames; // compressed and decompressed sizes
+};
+#endif
+
+Codec detect_codec(int fd)
+{
+    std::uint8_t magic[4];
+    if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+        return Codec::NONE;
+
+    return detect_codec(View(magic, sizeof(magic)));
+}
+
+Codec detect_codec(View magic)
+{
+    if (magic.size() < 4)
+        return Codec::NONE;
+
+    if (magic[0] == 0x1F && magic[1] == 0x8B)
+        return Codec::GZIP;
+
+    if (magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD)
+        return Codec::ZSTD;
+
+    return Codec::NONE;
+}
+
+std::unique_ptr<Decoder> make_decoder(Codec codec, [[maybe_unused]] int fd, [[maybe_unused]] View buffered)
+{
+    switch (codec)
+    {
+    case Codec::GZIP:
+#ifdef TAR_HAVE_ZLIB
+        return std::make_unique<GzipDecoder>(fd, buffered);
+#else
+        throw std::runtime_error("gzip support was not compiled in");
+#endif
+    case Codec::ZSTD:
+#ifdef TAR_HAVE_ZSTD
+        return std::make_unique<ZstdDecoder>(fd, buffered);
+#else
+        throw std::runtime_error("zstd support was not compiled in");
+#endif
+    default:
+        return nullptr;
+    }
+}
+
+Status read_seek_table(int fd, std::vector<Frame>& frames)
+{
+    struct stat info;
+    std::uint8_t footer[SEEK_TABLE_FOOTER];
+    if (fstat(fd, &info) < 0 || info.st_size < static_cast<off_t>(8 + SEEK_TABLE_FOOTER)
+        || pread(fd, footer, sizeof(footer), info.st_size - sizeof(footer)) != sizeof(footer)
+        || get_le32(footer + 5) != SEEKABLE_MAGIC)
+        return Status::END;
+
+    // Checksums are 4 more bytes per entry, they are skipped
+    std::uint32_t count       = get_le32(footer);
+    std::size_t   entry_size  = footer[4] & 0x80 ? 12 : 8;
+    std::uint64_t table_size  = 8 + static_cast<std::uint64_t>(count) * entry_size + SEEK_TABLE_FOOTER;
+    if (table_size > static_cast<std::uint64_t>(info.st_size))
+        return Status::ERROR;
+
+    Data table(table_size - SEEK_TABLE_FOOTER);
+    if (pread(fd, table.data(), table.size(), info.st_size - table_size) != static_cast<ssize_t>(table.size())
+        || get_le32(table.data()) != SKIPPABLE_MAGIC || get_le32(table.data() + 4) != table_size - 8)
+        return Status::ERROR;
+
+    Frame frame { 0, 0 };
+    frames.clear();
+    for (std::uint32_t i = 0; i < count; ++i)
+    {
+        const std::uint8_t* entry = table.data() + 8 + i * entry_size;
+        frames.push_back(frame);
+        frame.compressed += get_le32(entry);
+        frame.uncompressed += get_le32(entry + 4);
+    }
+
+    return Status::OK;
+}
+
+bool codec_available(Codec codec)
+{
+    switch (codec)
+    {
+    case Codec::GZIP:
+#ifdef TAR_HAVE_ZLIB
+        return true;
+#else
+        return false;
+#endif
+    case Codec::ZSTD:
+#ifdef TAR_HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    default:
+        return true;
+    }
+}
+
+std::unique_ptr<Encoder>
+make_encoder(Codec codec, [[maybe_unused]] int fd, [[maybe_unused]] std::uint32_t threads, [[maybe_unused]] bool seekable)
+{
+    if (seekable && codec != Codec::ZSTD)
+        throw std::runtime_error("Only zstd archives can be seekable");
+
+    switch (codec)
+    {
+    case Codec::GZIP:
+#ifdef TAR_HAVE_ZLIB
+        return std::make_unique<GzipEncoder>(fd);
+#else
+        throw std::runtime_error("gzip support was not compiled in");
+#endif
+    case Codec::ZSTD:
+#ifdef TAR_HAVE_ZSTD
+        return std::make_unique<ZstdEncoder>(fd, threads, seekable);
+#else
+        throw std::runtime_error("zstd support was not compiled in");
+#endif
+    default:
+        return nullptr;
+    }
+}
+}
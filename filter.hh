@@ -0,0 +1,64 @@
+#ifndef FILTER_HH
+#define FILTER_HH
+
+#include "tarstream.hh"
+#include <sys/types.h>
+
+namespace TAR
+{
+// Turns the compressed contents of a file back into the tar stream
+class Decoder
+{
+public:
+    virtual ~Decoder() = default;
+
+    // Fill up to size bytes. Returns the number of bytes decoded, 0 at the
+    // end of the data and -1 on errors(including truncated input).
+    virtual ssize_t read(std::uint8_t* data, std::size_t size) = 0;
+
+    // Start decoding again at offset of the file, which has to be where a
+    // gzip member or zstd frame starts
+    virtual Status rewind(std::uint64_t offset = 0) = 0;
+};
+
+// Compresses the tar stream into a file
+class Encoder
+{
+public:
+    virtual ~Encoder() = default;
+
+    virtual Status write(const std::uint8_t* data, std::size_t size) = 0;
+
+    // Flush everything and write the end of the compressed stream
+    virtual Status finish() = 0;
+
+    // Seekable encoders end the current frame, so that decoding can start
+    // at the next one. Nothing for the others.
+    virtual Status end_frame() { return Status::OK; }
+
+    // Uncompressed bytes in the current frame of seekable encoders
+    virtual std::uint64_t frame_size() const { return 0; }
+};
+
+// Look at the magic bytes at the start of the file
+Codec detect_codec(int fd);
+
+// The same for the first bytes of a pipe, which can not be read twice
+Codec detect_codec(View start);
+
+// Whether support for the codec was compiled in
+bool codec_available(Codec codec);
+
+// Both throw std::runtime_error for codecs that were not compiled in.
+// buffered holds bytes already read from fd, which are decoded first.
+std::unique_ptr<Decoder> make_decoder(Codec codec, int fd, View buffered = {});
+
+// seekable writes zstd archives as independent frames followed by a seek
+// table in the zstd seekable format, which plain zstd readers skip
+std::unique_ptr<Encoder> make_encoder(Codec codec, int fd, std::uint32_t threads = 1, bool seekable = false);
+
+// Read the seek table at the end of a seekable zstd archive. END if it has
+// none.
+Status read_seek_table(int fd, std::vector<Frame>& frames);
+}
+#endif // FILTER_HH
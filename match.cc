@@ -0,0 +1,276 @@
+#include "match.hh"
+
+namespace TAR
+{
+// Names are compared without leading / and ./ or trailing /
+static std::string_view normalize(std::string_view name)
+{
+    while (true)
+    {
+        if (name.starts_with('/'))
+            name.remove_prefix(1);
+        else if (name.starts_with("./"))
+            name.remove_prefix(2);
+        else
+            break;
+    }
+
+    while (name.ends_with('/'))
+        name.remove_suffix(1);
+
+    return name == "." ? std::string_view() : name;
+}
+
+static bool is_glob(std::string_view pattern)
+{
+    return pattern.find_first_of("*?[") != std::string_view::npos;
+}
+
+// [abc], [a-z] and [!a] or [^a]. Returns the end of the class, or npos if it
+// is not closed and the [ is a plain character.
+static std::size_t parse_class(std::string_view pattern, std::size_t start, std::bitset<256>& chars)
+{
+    std::size_t i      = start + 1;
+    bool        negate = i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^');
+    if (negate)
+        i++;
+
+    // A ] right after the opening one is part of the set
+    std::size_t first = i;
+    for (; i < pattern.size() && (pattern[i] != ']' || i == first); ++i)
+    {
+        unsigned char low = pattern[i];
+        if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']')
+        {
+            unsigned char high = pattern[i + 2];
+            for (unsigned c = low; c <= high; ++c)
+                chars.set(c);
+            i += 2;
+        }
+        else
+            chars.set(low);
+    }
+
+    if (i >= pattern.size())
+        return std::string_view::npos;
+
+    if (negate)
+        chars.flip();
+
+    return i;
+}
+
+Matcher::Glob::Glob(std::string_view pattern)
+{
+    bool literal = true; // no wildcard yet
+    for (std::size_t i = 0; i < pattern.size(); ++i)
+    {
+        Token         token;
+        unsigned char c = pattern[i];
+        if (c == '*')
+        {
+            // Runs of * are one
+            if (tokens.empty() || !tokens.back().star)
+            {
+                token.star = true;
+                tokens.push_back(token);
+            }
+            literal = false;
+            suffix.clear();
+            continue;
+        }
+
+        std::size_t end;
+        if (c == '?')
+            token.chars.set();
+        else if (c == '[' && (end = parse_class(pattern, i, token.chars)) != std::string_view::npos)
+            i = end;
+        else
+        {
+            if (c == '\\' && i + 1 < pattern.size())
+                c = pattern[++i];
+            token.chars.set(c);
+            tokens.push_back(token);
+            if (literal)
+                prefix += c;
+            suffix += c;
+            continue;
+        }
+
+        tokens.push_back(token);
+        literal = false;
+        suffix.clear();
+    }
+}
+
+// Greedy with a single backtrack point at the last *, which is enough since a
+// later * can take whatever an earlier one would have
+bool Matcher::Glob::matches(std::string_view name, bool partial) const
+{
+    std::size_t common = std::min(name.size(), prefix.size());
+    if (name.compare(0, common, prefix, 0, common) || (!partial && name.size() < prefix.size()))
+        return false;
+    if (!partial && !name.ends_with(suffix))
+        return false;
+
+    std::size_t t = 0, p = 0;
+    std::size_t star_p = std::string_view::npos, star_t = 0;
+    while (true)
+    {
+        if (t == name.size())
+        {
+            // Whatever tokens are left can be matched by adding to the name
+            if (partial)
+                return true;
+            while (p < tokens.size() && tokens[p].star)
+                p++;
+            return p == tokens.size();
+        }
+
+        if (p < tokens.size())
+        {
+            if (tokens[p].star)
+            {
+                star_p = p++;
+                star_t = t;
+                continue;
+            }
+            if (tokens[p].chars.test(static_cast<unsigned char>(name[t])))
+            {
+                p++;
+                t++;
+                continue;
+            }
+        }
+
+        if (star_p == std::string_view::npos)
+            return false;
+        p = star_p + 1;
+        t = ++star_t;
+    }
+}
+
+void Matcher::Rules::add(std::string_view pattern)
+{
+    if (is_glob(pattern))
+    {
+        globs.emplace_back(pattern);
+        return;
+    }
+
+    Node* node = &prefixes;
+    while (!pattern.empty())
+    {
+        std::size_t      slash     = pattern.find('/');
+        std::string_view component = pattern.substr(0, slash);
+        pattern.remove_prefix(slash == std::string_view::npos ? pattern.size() : slash + 1);
+        if (component.empty())
+            continue;
+
+        auto& child = node->children[std::string(component)];
+        if (!child)
+            child = std::make_unique<Node>();
+        node = child.get();
+    }
+    node->terminal = true;
+}
+
+bool Matcher::Rules::matches(std::string_view name) const
+{
+    const Node* node = &prefixes;
+    for (std::size_t start = 0; !node->terminal && start < name.size();)
+    {
+        std::size_t slash = name.find('/', start);
+        if (slash == std::string_view::npos)
+            slash = name.size();
+
+        auto child = node->children.find(name.substr(start, slash - start));
+        if (child == node->children.end())
+            break;
+        node  = child->second.get();
+        start = slash + 1;
+    }
+    if (node->terminal)
+        return true;
+
+    if (globs.empty())
+        return false;
+
+    // The directories above the name, then the name itself
+    for (std::size_t slash = name.find('/'); slash != std::string_view::npos; slash = name.find('/', slash + 1))
+    {
+        for (const auto& glob : globs)
+        {
+            if (glob.matches(name.substr(0, slash), false))
+                return true;
+        }
+    }
+
+    for (const auto& glob : globs)
+    {
+        if (glob.matches(name, false))
+            return true;
+    }
+
+    return false;
+}
+
+bool Matcher::Rules::matches_below(std::string_view directory) const
+{
+    const Node* node = &prefixes;
+    for (std::size_t start = 0; node && start < directory.size();)
+    {
+        std::size_t slash = directory.find('/', start);
+        if (slash == std::string_view::npos)
+            slash = directory.size();
+
+        auto child = node->children.find(directory.substr(start, slash - start));
+        node       = child == node->children.end() ? nullptr : child->second.get();
+        start      = slash + 1;
+    }
+    if (node && !node->children.empty())
+        return true;
+
+    std::string below = directory.empty() ? std::string() : std::string(directory) + '/';
+    for (const auto& glob : globs)
+    {
+        if (glob.matches(below, true))
+            return true;
+    }
+
+    return false;
+}
+
+void Matcher::include(std::string_view pattern)
+{
+    m_include.add(normalize(pattern));
+}
+
+void Matcher::exclude(std::string_view pattern)
+{
+    m_exclude.add(normalize(pattern));
+}
+
+bool Matcher::empty() const
+{
+    return m_include.empty() && m_exclude.empty();
+}
+
+bool Matcher::selects(std::string_view name) const
+{
+    name = normalize(name);
+    if (!m_include.empty() && !m_include.matches(name))
+        return false;
+
+    return m_exclude.empty() || !m_exclude.matches(name);
+}
+
+bool Matcher::may_contain(std::string_view directory) const
+{
+    directory = normalize(directory);
+    if (!m_exclude.empty() && m_exclude.matches(directory))
+        return false;
+
+    return m_include.empty() || m_include.matches(directory) || m_include.matches_below(directory);
+}
+}
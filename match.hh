@@ -0,0 +1,87 @@
+#ifndef MATCH_HH
+#define MATCH_HH
+
+#include <bitset>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace TAR
+{
+// Include and exclude rules for member names, compiled once and then tested
+// against every member or path. A pattern with *, ? or [...] in it is a glob,
+// where * also matches /. Any other pattern is a prefix that matches the
+// name itself and everything below it. Leading / and ./ as well as trailing
+// / are ignored on both sides.
+//
+// A name is selected if it, or a directory above it, matches an include
+// rule(or there are none) and neither it nor a directory above it matches an
+// exclude rule.
+class Matcher
+{
+public:
+    Matcher() = default;
+
+    void include(std::string_view pattern);
+
+    void exclude(std::string_view pattern);
+
+    // No rules, everything is selected
+    bool empty() const;
+
+    bool selects(std::string_view name) const;
+
+    // Whether the directory or anything below it can be selected, so that
+    // directories which can not are never read
+    bool may_contain(std::string_view directory) const;
+
+private:
+    // One path component per level, terminal where a prefix pattern ends
+    struct Node
+    {
+        std::map<std::string, std::unique_ptr<Node>, std::less<>> children;
+        bool                                                      terminal = false;
+    };
+
+    // A glob compiled to one character set per position, * are runs
+    struct Glob
+    {
+        struct Token
+        {
+            bool             star = false;
+            std::bitset<256> chars;
+        };
+
+        Glob(std::string_view pattern);
+
+        // partial matches when name is the start of something that matches
+        bool matches(std::string_view name, bool partial) const;
+
+        std::vector<Token> tokens;
+        std::string        prefix; // literal text before the first wildcard
+        std::string        suffix; // literal text after the last wildcard
+    };
+
+    struct Rules
+    {
+        void add(std::string_view pattern);
+
+        bool empty() const { return !prefixes.terminal && prefixes.children.empty() && globs.empty(); }
+
+        // The name or a directory above it matches
+        bool matches(std::string_view name) const;
+
+        // Something below the directory matches
+        bool matches_below(std::string_view directory) const;
+
+        Node              prefixes;
+        std::vector<Glob> globs;
+    };
+
+    Rules m_include;
+    Rules m_exclude;
+};
+}
+#endif // MATCH_HH
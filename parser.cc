@@ -1,21 +1,253 @@
 #include "tarstream.hh"
+#include "digest.hh"
+#include "stats.hh"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+static int usage()
+{
+    std::cerr << "Usage: parser [--mmap|--uring] [--buffer-size bytes] [--stats] [--verify] [-j[threads]] [--check-digests [--manifest file [--digest sha256|xxh64]]] [--write-index index] [--index index] [--find name]... [--include pattern]... [--exclude pattern]... input.tar|-\n";
+    return 1;
+}
+
+// Counters and timers are only there in builds with make STATS=1
+static void print_stats()
+{
+#ifdef TAR_STATS
+    TAR::print_stats(std::cerr);
+#else
+    std::cerr << "Statistics were not compiled in, rebuild with make STATS=1\n";
+#endif
+}
 
 int main(int argc, char** argv)
 {
-    if (argc != 2)
+    TAR::Backend             backend = TAR::Backend::STREAM;
+    std::string              write_index, index, manifest_path;
+    std::vector<std::string> names;
+    TAR::Matcher             matcher;
+    std::size_t              buffer_size = TAR::DEFAULT_BUFFER_SIZE;
+    bool                     stats       = false;
+    bool                     verify      = false;
+    bool                     check       = false;
+    TAR::Digest              digest      = TAR::Digest::SHA256;
+    std::uint32_t            threads     = 1;
+
+    int i = 1;
+    for (; i < argc - 1; ++i)
+    {
+        if (!std::strcmp(argv[i], "--mmap"))
+            backend = TAR::Backend::MMAP;
+        else if (!std::strcmp(argv[i], "--uring"))
+            backend = TAR::Backend::URING;
+        else if (!std::strcmp(argv[i], "--stats"))
+            stats = true;
+        else if (!std::strcmp(argv[i], "--verify"))
+            verify = true;
+        else if (!std::strcmp(argv[i], "--check-digests"))
+            check = true;
+        else if (!std::strcmp(argv[i], "--manifest") && i + 2 < argc)
+            manifest_path = argv[++i];
+        else if (!std::strcmp(argv[i], "--digest") && i + 2 < argc)
+        {
+            digest = TAR::parse_digest(argv[++i]);
+            if (digest == TAR::Digest::NONE)
+                return usage();
+        }
+        else if (std::string(argv[i]).starts_with("-j"))
+            threads = argv[i][2] ? std::stoul(argv[i] + 2) : 0;
+        else if (!std::strcmp(argv[i], "--buffer-size") && i + 2 < argc)
+            buffer_size = std::stoul(argv[++i]);
+        else if (!std::strcmp(argv[i], "--write-index") && i + 2 < argc)
+            write_index = argv[++i];
+        else if (!std::strcmp(argv[i], "--index") && i + 2 < argc)
+            index = argv[++i];
+        else if (!std::strcmp(argv[i], "--find") && i + 2 < argc)
+            names.push_back(argv[++i]);
+        else if (!std::strcmp(argv[i], "--include") && i + 2 < argc)
+            matcher.include(argv[++i]);
+        else if (!std::strcmp(argv[i], "--exclude") && i + 2 < argc)
+            matcher.exclude(argv[++i]);
+        else
+            return usage();
+    }
+
+    if (i != argc - 1)
+        return usage();
+
+    if (buffer_size > TAR::MAX_BUFFER_SIZE)
+    {
+        std::cerr << "--buffer-size can be at most " << TAR::MAX_BUFFER_SIZE << " bytes\n";
+        return 1;
+    }
+
+    // - reads the archive from stdin, forward only
+    std::unique_ptr<TAR::InStream> stream(std::strcmp(argv[i], "-") ? new TAR::InStream(argv[i], 20, backend, buffer_size)
+                                                                    : new TAR::InStream(STDIN_FILENO, 20, buffer_size));
+    TAR::InStream&                 in = *stream;
+    TAR::Parser                    parser(in);
+
+    if (!write_index.empty() && parser.write_index(write_index, threads) != TAR::Status::OK)
+    {
+        std::cerr << "Error: could not write the index!\n";
+        return 1;
+    }
+
+    if (!index.empty() && parser.load_index(index) != TAR::Status::OK)
     {
-        std::cerr << "Usage: parser input.tar\n";
+        std::cerr << "Error: could not load the index!\n";
         return 1;
     }
 
-    std::list<TAR::File> files;
-    TAR::InStream        in(argv[1]);
-    TAR::Parser          parser(in);
-    parser.list_files(files);
+    // One forward pass over the data, against the digest records in the
+    // archive or a sha256sum style manifest
+    if (check)
+    {
+        TAR::Manifest manifest;
+        if (!manifest_path.empty() && TAR::read_manifest(manifest_path, manifest) != TAR::Status::OK)
+            return 1;
+
+        std::uint64_t checked, failed;
+        if (parser.check_digests(checked, failed, manifest_path.empty() ? nullptr : &manifest, digest) != TAR::Status::OK)
+        {
+            std::cerr << "Error: could not read every member!\n";
+            return 1;
+        }
+
+        std::cout << checked << " members checked, " << failed << " failed\n";
+        if (stats)
+            print_stats();
+        return failed ? 1 : 0;
+    }
+
+    // Pipes can only be read once, so their members are counted on the way
+    if (verify && !in.seekable())
+    {
+        std::uint64_t members = 0, bytes = 0;
+        auto          count   = [&members, &matcher](const TAR::File& file)
+        {
+            if (!matcher.selects(file.name))
+                return false;
+            members++;
+            return true;
+        };
+        auto read = [&bytes](const TAR::File&, std::uint64_t, TAR::View chunk)
+        {
+            bytes += chunk.size();
+            return TAR::Status::OK;
+        };
+
+        if (parser.stream(read, count) != TAR::Status::OK)
+        {
+            std::cerr << "Error: could not read every member!\n";
+            return 1;
+        }
+
+        std::cout << members << " members, " << bytes << " bytes read\n";
+        if (stats)
+            print_stats();
+        return 0;
+    }
+
+    // Read the data of every member, on several threads with -j
+    if (verify)
+    {
+        std::list<TAR::File> files;
+        if (parser.list_files(files, &matcher, threads) != TAR::Status::OK)
+        {
+            std::cerr << "Error: could not list the archive!\n";
+            return 1;
+        }
+
+        std::atomic<std::uint64_t> bytes(0);
+        std::atomic<std::uint8_t>  touched(0);
+        auto                       check = [&bytes, &touched](const TAR::File&, TAR::View data)
+        {
+            // Touch every page, mapped archives are not read otherwise
+            std::uint8_t sum = 0;
+            for (std::size_t i = 0; i < data.size(); i += 4096)
+                sum |= data[i];
+            touched.fetch_or(sum, std::memory_order_relaxed);
+            bytes += data.size();
+
+            return TAR::Status::OK;
+        };
+
+        if (parser.for_each_file(files, check, threads) != TAR::Status::OK)
+        {
+            std::cerr << "Error: could not read every member!\n";
+            return 1;
+        }
+
+        std::cout << files.size() << " members, " << bytes << " bytes read\n";
+        if (stats)
+            print_stats();
+        return 0;
+    }
+
+    // Print the contents of the requested members
+    if (!names.empty())
+    {
+        for (const auto& name : names)
+        {
+            TAR::File file;
+            if (parser.find(name, file) != TAR::Status::OK)
+            {
+                std::cerr << "Error: " << name << " not found!\n";
+                return 1;
+            }
+
+            auto data = parser.read_file(file);
+            if (data.size() != file.header.size_in_bytes())
+            {
+                std::cerr << "Error: could not read " << name << "!\n";
+                return 1;
+            }
+            std::fwrite(data.data(), 1, data.size(), stdout);
+        }
+
+        if (stats)
+            print_stats();
+        return 0;
+    }
+
+    if (!write_index.empty())
+    {
+        if (stats)
+            print_stats();
+        return 0;
+    }
+
+    // Several threads scan the archive in ranges, which needs every member
+    // in memory at once
+    if (threads != 1)
+    {
+        std::list<TAR::File> files;
+        if (parser.list_files(files, &matcher, threads) != TAR::Status::OK)
+        {
+            std::cerr << "Error: could not list the archive!\n";
+            return 1;
+        }
+
+        for (const auto& file : files)
+            std::cout << file.name << '\n';
+    }
+    else
+    {
+        TAR::Listing listing;
+        parser.list_members(listing, &matcher);
+
+        for (const auto& member : listing.members)
+            std::cout << listing.name(member) << '\n';
+    }
 
-    for (const auto& file : files)
-        std::cout << file.name << '\n';
+    if (stats)
+        print_stats();
 
     return 0;
 }
@@ -0,0 +1,107 @@
+#include "stats.hh"
+
+#ifdef TAR_STATS
+#    include <bit>
+#    include <iomanip>
+
+namespace TAR
+{
+LiveStats live_stats;
+
+static const char* counter_names[] = {
+    "bytes read",
+    "bytes written",
+    "blocks read",
+    "blocks written",
+    "records read",
+    "records written",
+    "syscalls",
+    "members",
+};
+
+static const char* phase_names[] = {
+    "stat",
+    "user/group lookup",
+    "member reads",
+    "checksum",
+    "kernel copy",
+    "compress",
+    "archive writes",
+    "archive reads",
+    "decompress",
+    "digests",
+};
+
+static_assert(std::size(counter_names) == static_cast<std::size_t>(Counter::COUNT));
+static_assert(std::size(phase_names) == static_cast<std::size_t>(Phase::COUNT));
+
+void count_member(std::uint64_t size)
+{
+    live_stats.counters[static_cast<std::size_t>(Counter::MEMBERS)].fetch_add(1, std::memory_order_relaxed);
+    live_stats.member_sizes[std::bit_width(size)].fetch_add(1, std::memory_order_relaxed);
+}
+
+Stats stats()
+{
+    Stats snapshot;
+    for (std::size_t i = 0; i < std::size(snapshot.counters); ++i)
+        snapshot.counters[i] = live_stats.counters[i].load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i < std::size(snapshot.nanoseconds); ++i)
+        snapshot.nanoseconds[i] = live_stats.nanoseconds[i].load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i < SIZE_BUCKETS; ++i)
+        snapshot.member_sizes[i] = live_stats.member_sizes[i].load(std::memory_order_relaxed);
+
+    return snapshot;
+}
+
+void reset_stats()
+{
+    for (auto& counter : live_stats.counters)
+        counter.store(0, std::memory_order_relaxed);
+    for (auto& nanoseconds : live_stats.nanoseconds)
+        nanoseconds.store(0, std::memory_order_relaxed);
+    for (auto& bucket : live_stats.member_sizes)
+        bucket.store(0, std::memory_order_relaxed);
+}
+
+// Sizes as 512 B, 4 KiB, 1 MiB...
+static std::string size_name(std::uint64_t size)
+{
+    const char* units[] = { "B", "KiB", "MiB", "GiB", "TiB", "PiB", "EiB" };
+    std::size_t unit    = 0;
+    while (size >= 1024 && size % 1024 == 0)
+    {
+        size /= 1024;
+        unit++;
+    }
+
+    return std::to_string(size) + " " + units[unit];
+}
+
+void print_stats(std::ostream& out)
+{
+    Stats snapshot = stats();
+
+    out << "Counters:\n";
+    for (std::size_t i = 0; i < std::size(snapshot.counters); ++i)
+        out << "  " << std::left << std::setw(20) << counter_names[i] << std::right << snapshot.counters[i] << '\n';
+
+    out << "Phases(summed over threads):\n";
+    for (std::size_t i = 0; i < std::size(snapshot.nanoseconds); ++i)
+        out << "  " << std::left << std::setw(20) << phase_names[i] << std::right << std::fixed << std::setprecision(3)
+            << snapshot.nanoseconds[i] / 1e6 << " ms\n";
+
+    out << "Member sizes:\n";
+    for (std::size_t i = 0; i < SIZE_BUCKETS; ++i)
+    {
+        if (!snapshot.member_sizes[i])
+            continue;
+
+        std::string range = i ? "< " + size_name(std::uint64_t(1) << std::min<std::size_t>(i, 63)) : "0 B";
+        if (i == SIZE_BUCKETS - 1)
+            range = ">= 8 EiB";
+        out << "  " << std::left << std::setw(20) << range << std::right << snapshot.member_sizes[i] << '\n';
+    }
+}
+}
+#endif
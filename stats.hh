@@ -0,0 +1,114 @@
+#ifndef STATS_HH
+#define STATS_HH
+
+// Counters and phase timers for finding out where the time of a job goes.
+// They are only built with TAR_STATS(make STATS=1), otherwise the macros
+// below expand to nothing and none of this exists.
+#ifdef TAR_STATS
+#    include <atomic>
+#    include <chrono>
+#    include <cstdint>
+#    include <ostream>
+
+namespace TAR
+{
+enum class Counter
+{
+    BYTES_READ,      // archive bytes read by InStream
+    BYTES_WRITTEN,   // archive bytes written by OutStream
+    BLOCKS_READ,     // blocks handed out by InStream
+    BLOCKS_WRITTEN,  // blocks put in the archive by OutStream
+    RECORDS_READ,    // records handed out by InStream
+    RECORDS_WRITTEN, // records put in the archive by OutStream
+    SYSCALLS,        // file system calls made by the library
+    MEMBERS,         // members parsed or archived
+    COUNT
+};
+
+// Phases are timed on the thread that runs them, so with several threads
+// they add up to more than the wall clock time
+enum class Phase
+{
+    STAT,       // statx, readlink and directory listing
+    LOOKUP,     // user and group names
+    READ,       // member data read while archiving
+    CHECKSUM,   // header checksums
+    COPY,       // member data moved by the kernel
+    COMPRESS,   // encoding the archive
+    WRITE,      // writing the archive
+    FILL,       // reading the archive
+    DECOMPRESS, // decoding the archive
+    DIGEST,     // member digests
+    COUNT
+};
+
+// Member sizes by powers of two, bucket b counts sizes below 2^b
+constexpr std::size_t SIZE_BUCKETS = 65;
+
+struct Stats
+{
+    std::uint64_t counters[static_cast<std::size_t>(Counter::COUNT)];
+    std::uint64_t nanoseconds[static_cast<std::size_t>(Phase::COUNT)];
+    std::uint64_t member_sizes[SIZE_BUCKETS];
+};
+
+// A snapshot of everything counted since the start or reset_stats
+Stats stats();
+
+void reset_stats();
+
+void print_stats(std::ostream& out);
+
+struct LiveStats
+{
+    std::atomic<std::uint64_t> counters[static_cast<std::size_t>(Counter::COUNT)];
+    std::atomic<std::uint64_t> nanoseconds[static_cast<std::size_t>(Phase::COUNT)];
+    std::atomic<std::uint64_t> member_sizes[SIZE_BUCKETS];
+};
+
+extern LiveStats live_stats;
+
+inline void count(Counter counter, std::uint64_t n)
+{
+    live_stats.counters[static_cast<std::size_t>(counter)].fetch_add(n, std::memory_order_relaxed);
+}
+
+void count_member(std::uint64_t size);
+
+class PhaseTimer
+{
+public:
+    PhaseTimer(Phase phase)
+        : m_phase(phase)
+        , m_start(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~PhaseTimer()
+    {
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start);
+        live_stats.nanoseconds[static_cast<std::size_t>(m_phase)].fetch_add(elapsed.count(), std::memory_order_relaxed);
+    }
+
+    PhaseTimer(const PhaseTimer& other) = delete;
+
+    PhaseTimer& operator=(const PhaseTimer& other) = delete;
+
+private:
+    Phase                                 m_phase;
+    std::chrono::steady_clock::time_point m_start;
+};
+}
+
+#    define TAR_CONCAT_(a, b) a##b
+#    define TAR_CONCAT(a, b) TAR_CONCAT_(a, b)
+#    define TAR_COUNT(counter, n) ::TAR::count(::TAR::Counter::counter, n)
+#    define TAR_MEMBER(size) ::TAR::count_member(size)
+// Time the rest of the enclosing scope
+#    define TAR_TIME(phase) ::TAR::PhaseTimer TAR_CONCAT(tar_timer_, __LINE__)(::TAR::Phase::phase)
+#else
+#    define TAR_COUNT(counter, n) ((void)0)
+#    define TAR_MEMBER(size) ((void)0)
+#    define TAR_TIME(phase) ((void)0)
+#endif
+#endif // STATS_HH
@@ -1,18 +1,71 @@
 #include "tarstream.hh"
+#include "digest.hh"
+#include "filter.hh"
+#include "stats.hh"
+#include "uring.hh"
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <dirent.h>
+#include <deque>
+#include <fcntl.h>
 #include <grp.h>
 #include <iterator>
+#include <numeric>
 #include <pwd.h>
-#include <queue>
 #include <sstream>
 #include <string>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <unordered_set>
+#include <utility>
+#if defined(__x86_64__) || defined(__i386__)
+#    include <immintrin.h>
+#endif
 
 namespace TAR
 {
 // Make sure that a block is exactly BLOCK_SIZE bytes
 static_assert(sizeof(Block) == BLOCK_SIZE);
+// The index is written to disk as is
+static_assert(sizeof(IndexEntry) == 40);
+// io_uring results are 32-bit, with room for O_DIRECT rounding up to pages
+static_assert(MAX_BUFFER_SIZE * 2 <= INT32_MAX + 1ul);
+
+// Header of the sidecar index file, followed by count IndexEntry records
+struct IndexHeader
+{
+    char          magic[8];
+    std::uint32_t blocking_factor;
+    std::uint32_t reserved;
+    std::uint64_t count;
+};
+
+constexpr char INDEX_MAGIC[8] = "TARIDX2";
+
+struct SnapshotHeader
+{
+    char          magic[8];
+    std::uint64_t count;
+};
+
+constexpr char SNAPSHOT_MAGIC[8] = "TARSNP1";
+
+// Records in flight per stream with the URING backend
+constexpr std::uint32_t URING_QUEUE_DEPTH = 8;
+
+// O_DIRECT wants offsets, sizes and addresses aligned to the logical block
+// size of the device, a page covers every common one
+constexpr std::size_t DIRECT_ALIGNMENT = 4096;
 
 std::ostream& operator<<(std::ostream& os, const Block& block)
 {
@@ -27,77 +80,452 @@ std::ostream& operator<<(std::ostream& os, const Block& block)
     return os;
 }
 
-std::uint32_t Block::calculate_checksum() const
+// The checksum is the sum of all the header bytes with the chksum field taken
+// as spaces. The kernels sum the whole block and then correct for the field.
+constexpr std::size_t CHKSUM_OFFSET = offsetof(Header, chksum);
+constexpr std::size_t CHKSUM_SIZE   = sizeof(Header::chksum);
+
+static std::uint32_t chksum_correction(const Block& block, std::uint32_t sum)
+{
+    for (std::size_t i = CHKSUM_OFFSET; i < CHKSUM_OFFSET + CHKSUM_SIZE; ++i)
+        sum -= block.as_data[i];
+
+    return sum + CHKSUM_SIZE * 0x20;
+}
+
+static std::uint32_t checksum_scalar(const Block& block)
 {
-    std::uint32_t       sum         = 0;
-    const std::uint8_t* chksum      = reinterpret_cast<const uint8_t*>(as_header.chksum);
-    auto                end_address = chksum + sizeof(as_header.chksum);
+    std::uint32_t sum = 0;
+    for (std::uint32_t i = 0; i < BLOCK_SIZE; ++i)
+        sum += block.as_data[i];
+
+    return chksum_correction(block, sum);
+}
 
-    for (std::uint16_t i = 0; i < BLOCK_SIZE; ++i)
+static bool is_zero_scalar(const Block& block)
+{
+    std::uint64_t acc = 0;
+    for (std::uint32_t i = 0; i < BLOCK_SIZE; i += sizeof(acc))
     {
-        if (&as_data[i] >= chksum && &as_data[i] < end_address)
-            sum += 0x20;
-        else
-            sum += as_data[i];
+        std::uint64_t word;
+        std::memcpy(&word, block.as_data + i, sizeof(word));
+        acc |= word;
     }
 
-    return sum;
+    return !acc;
 }
 
-bool Block::is_zero_block() const
+#if defined(__x86_64__)
+static std::uint32_t checksum_sse2(const Block& block)
+{
+    const __m128i  zero = _mm_setzero_si128();
+    const __m128i* data = reinterpret_cast<const __m128i*>(block.as_data);
+    __m128i        acc  = zero;
+
+    // psadbw against zero sums each group of 8 bytes into a 64 bit lane
+    for (std::uint32_t i = 0; i < BLOCK_SIZE / sizeof(__m128i); ++i)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128(data + i), zero));
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+
+    return chksum_correction(block, _mm_cvtsi128_si32(acc));
+}
+
+static bool is_zero_sse2(const Block& block)
+{
+    const __m128i* data = reinterpret_cast<const __m128i*>(block.as_data);
+
+    // Headers usually differ from zero early, so check every 128 bytes
+    for (std::uint32_t i = 0; i < BLOCK_SIZE / sizeof(__m128i); i += 8)
+    {
+        __m128i acc = _mm_or_si128(_mm_or_si128(_mm_or_si128(_mm_loadu_si128(data + i),
+                                                             _mm_loadu_si128(data + i + 1)),
+                                                _mm_or_si128(_mm_loadu_si128(data + i + 2),
+                                                             _mm_loadu_si128(data + i + 3))),
+                                   _mm_or_si128(_mm_or_si128(_mm_loadu_si128(data + i + 4),
+                                                             _mm_loadu_si128(data + i + 5)),
+                                                _mm_or_si128(_mm_loadu_si128(data + i + 6),
+                                                             _mm_loadu_si128(data + i + 7))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+            return false;
+    }
+
+    return true;
+}
+
+__attribute__((target("avx2"))) static std::uint32_t checksum_avx2(const Block& block)
+{
+    const __m256i  zero = _mm256_setzero_si256();
+    const __m256i* data = reinterpret_cast<const __m256i*>(block.as_data);
+    __m256i        acc  = zero;
+
+    for (std::uint32_t i = 0; i < BLOCK_SIZE / sizeof(__m256i); ++i)
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256(data + i), zero));
+
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    half         = _mm_add_epi64(half, _mm_unpackhi_epi64(half, half));
+
+    return chksum_correction(block, _mm_cvtsi128_si32(half));
+}
+
+__attribute__((target("avx2"))) static bool is_zero_avx2(const Block& block)
 {
-    for (std::uint16_t i = 0; i < BLOCK_SIZE; ++i)
-        if (as_data[i])
+    const __m256i* data = reinterpret_cast<const __m256i*>(block.as_data);
+
+    for (std::uint32_t i = 0; i < BLOCK_SIZE / sizeof(__m256i); i += 4)
+    {
+        __m256i acc = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(data + i),
+                                                      _mm256_loadu_si256(data + i + 1)),
+                                      _mm256_or_si256(_mm256_loadu_si256(data + i + 2),
+                                                      _mm256_loadu_si256(data + i + 3)));
+        if (!_mm256_testz_si256(acc, acc))
             return false;
+    }
 
     return true;
 }
+#endif
+
+const std::vector<BlockKernel>& block_kernels()
+{
+    static const std::vector<BlockKernel> kernels = []()
+    {
+        std::vector<BlockKernel> available;
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("avx2"))
+            available.push_back({ "avx2", checksum_avx2, is_zero_avx2 });
+        available.push_back({ "sse2", checksum_sse2, is_zero_sse2 });
+#endif
+        available.push_back({ "scalar", checksum_scalar, is_zero_scalar });
+
+        return available;
+    }();
+
+    return kernels;
+}
+
+// Resolved once at startup so the hot paths pay a single indirect call
+static const BlockKernel& active_kernel = block_kernels().front();
+
+std::uint32_t Block::calculate_checksum() const
+{
+    return active_kernel.checksum(*this);
+}
+
+bool Block::is_zero_block() const
+{
+    return active_kernel.is_zero(*this);
+}
 
-std::uint32_t Header::size_in_blocks() const
+std::uint64_t Header::size_in_blocks() const
 {
-    std::uint32_t bytes = std::stoi(size, nullptr, 8);
+    std::uint64_t bytes = parse_number(size);
     if (!bytes)
         return 0;
 
-    std::uint32_t blocks = bytes / BLOCK_SIZE;
+    std::uint64_t blocks = bytes / BLOCK_SIZE;
     if (bytes % BLOCK_SIZE)
         blocks++;
 
     return blocks;
 }
 
-std::uint32_t Header::size_in_bytes() const
+std::uint64_t Header::size_in_bytes() const
+{
+    return parse_number(size);
+}
+
+std::uint64_t parse_number(const char* field, std::size_t length)
+{
+    auto bytes = reinterpret_cast<const std::uint8_t*>(field);
+
+    // Base-256 sets the top bit of the first byte, the rest is big endian.
+    // Negative numbers are not expected in the fields read here.
+    if (length && bytes[0] & 0x80)
+    {
+        if (bytes[0] & 0x40)
+            return 0;
+
+        std::uint64_t value = bytes[0] & 0x3f;
+        for (std::size_t i = 1; i < length; ++i)
+            value = value << 8 | bytes[i];
+
+        return value;
+    }
+
+    std::size_t i = 0;
+    while (i < length && field[i] == ' ')
+        i++;
+
+    std::uint64_t value = 0;
+    for (; i < length && field[i] >= '0' && field[i] <= '7'; ++i)
+        value = value << 3 | (field[i] - '0');
+
+    return value;
+}
+
+void format_number(char* field, std::size_t length, std::uint64_t value)
+{
+    // length - 1 octal digits and a NUL, like "%0*o"
+    std::size_t digits = length - 1;
+    if (3 * digits >= 64 || value >> 3 * digits == 0)
+    {
+        field[digits] = '\0';
+        for (std::size_t i = digits; i > 0; --i, value >>= 3)
+            field[i - 1] = '0' + (value & 7);
+        return;
+    }
+
+    field[0] = static_cast<char>(0x80);
+    for (std::size_t i = length - 1; i > 0; --i, value >>= 8)
+        field[i] = static_cast<char>(value & 0xff);
+}
+
+void BufferDeleter::operator()(Block* blocks) const
 {
-    return std::stoi(size, nullptr, 8);
+    std::free(blocks);
+}
+
+static Buffer make_buffer(std::size_t blocks)
+{
+    std::size_t size = (blocks * BLOCK_SIZE + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+    void*       data = std::aligned_alloc(DIRECT_ALIGNMENT, size);
+    if (!data)
+        throw std::bad_alloc();
+
+    return Buffer(static_cast<Block*>(data));
 }
 
-BlockStream::BlockStream(const std::string& file_path, std::uint32_t blocking_factor)
+BlockStream::BlockStream(const std::string& file_path, std::uint32_t blocking_factor, std::size_t buffer_size)
     : m_file_path(file_path)
     , m_blocking_factor(blocking_factor)
     , m_block_id(0)
     , m_record_id(0)
+    , m_records_per_buffer(std::max<std::size_t>(1, std::min(buffer_size, MAX_BUFFER_SIZE) / (blocking_factor * BLOCK_SIZE)))
+    , m_buffer_record(0)
+    , m_fd(-1)
+    , m_in_flight(0)
+    , m_io_error(false)
+{
+}
+
+BlockStream::~BlockStream() = default;
+
+bool BlockStream::start_ring()
+{
+    try
+    {
+        m_ring = std::make_unique<Uring>(URING_QUEUE_DEPTH);
+    }
+    catch (const std::runtime_error&)
+    {
+        return false;
+    }
+
+    m_slots.resize(URING_QUEUE_DEPTH);
+    for (auto& slot : m_slots)
+    {
+        slot.data      = make_buffer(m_records_per_buffer * m_blocking_factor);
+        slot.record_id = UINT64_MAX;
+        slot.busy      = false;
+    }
+
+    return true;
+}
+
+Status BlockStream::complete_one()
 {
+    std::uint64_t tag;
+    std::int32_t  result;
+    if (m_ring->wait(tag, result) != Status::OK)
+        return Status::ERROR;
+
+    RecordSlot& slot = m_slots[tag];
+    slot.result      = result;
+    slot.busy        = false;
+    m_in_flight--;
+
+    if (result != static_cast<std::int32_t>(slot.size))
+        m_io_error = true;
+
+    return Status::OK;
+}
+
+Status BlockStream::drain()
+{
+    while (m_in_flight)
+        if (complete_one() != Status::OK)
+            return Status::ERROR;
+
+    return Status::OK;
 }
 
-std::uint32_t BlockStream::record_id() { return m_record_id; }
+std::uint64_t BlockStream::record_id() { return m_record_id; }
 
 std::uint32_t BlockStream::block_id() { return m_block_id; }
 
-InStream::InStream(fs::path file_path, std::uint32_t blocking_factor)
-    : BlockStream(file_path, blocking_factor)
+std::uint32_t BlockStream::blocking_factor() { return m_blocking_factor; }
+
+const fs::path& BlockStream::file_path() { return m_file_path; }
+
+std::size_t BlockStream::buffer_size() { return static_cast<std::size_t>(m_records_per_buffer) * m_blocking_factor * BLOCK_SIZE; }
+
+Block* BlockStream::current_block() { return m_record.get() + m_buffer_record * m_blocking_factor + m_block_id; }
+
+InStream::InStream(fs::path file_path, std::uint32_t blocking_factor, Backend backend, std::size_t buffer_size)
+    : BlockStream(file_path, blocking_factor, buffer_size)
+    , m_backend(backend)
+    , m_next_record(0)
+    , m_buffer_first(0)
+    , m_buffered(0)
     , m_should_read(true)
+    , m_map(nullptr)
+    , m_map_size(0)
 {
-    m_records_in_file = fs::file_size(m_file_path) / (m_blocking_factor * BLOCK_SIZE);
-    m_stream.open(m_file_path, std::ios::in | std::ios::binary);
-    if (!m_stream)
+    m_fd = open(m_file_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (m_fd < 0)
     {
         std::string error_msg("Could not open file ");
         error_msg.append(file_path);
         throw std::runtime_error(error_msg);
     }
+
+    setup();
+}
+
+InStream::InStream(int fd, std::uint32_t blocking_factor, std::size_t buffer_size)
+    : BlockStream("/dev/fd/" + std::to_string(fd), blocking_factor, buffer_size)
+    , m_backend(Backend::STREAM)
+    , m_next_record(0)
+    , m_buffer_first(0)
+    , m_buffered(0)
+    , m_should_read(true)
+    , m_map(nullptr)
+    , m_map_size(0)
+{
+    m_fd = fd;
+    setup();
+}
+
+void InStream::setup()
+{
+    struct stat info;
+    if (fstat(m_fd, &info) < 0)
+    {
+        close(m_fd);
+        std::string error_msg("Could not stat file ");
+        error_msg.append(m_file_path);
+        throw std::runtime_error(error_msg);
+    }
+
+    // The magic bytes of a pipe are kept for whoever reads it first
+    m_seekable = S_ISREG(info.st_mode);
+    if (!m_seekable)
+    {
+        m_peek.resize(4);
+        std::size_t done = 0;
+        while (done < m_peek.size())
+        {
+            TAR_COUNT(SYSCALLS, 1);
+            ssize_t bytes = read(m_fd, m_peek.data() + done, m_peek.size() - done);
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            if (bytes < 0)
+            {
+                close(m_fd);
+                std::string error_msg("Could not read file ");
+                error_msg.append(m_file_path);
+                throw std::runtime_error(error_msg);
+            }
+            if (!bytes)
+                break;
+            done += bytes;
+        }
+        m_peek.resize(done);
+    }
+
+    // The size of a compressed archive is only known once it is decoded
+    m_codec = m_seekable ? detect_codec(m_fd) : detect_codec(m_peek);
+    if (m_codec != Codec::NONE)
+    {
+        m_backend         = Backend::STREAM;
+        m_records_in_file = UINT64_MAX;
+        try
+        {
+            m_decoder = make_decoder(m_codec, m_fd, m_peek);
+        }
+        catch (...)
+        {
+            close(m_fd);
+            throw;
+        }
+        m_peek.clear();
+
+        if (m_seekable && m_codec == Codec::ZSTD && read_seek_table(m_fd, m_frames) == Status::ERROR)
+        {
+            std::cerr << "Ignoring the broken seek table of " << m_file_path << '\n';
+            m_frames.clear();
+        }
+
+        return;
+    }
+
+    if (!m_seekable)
+    {
+        m_backend         = Backend::STREAM;
+        m_records_in_file = UINT64_MAX;
+        return;
+    }
+
+    m_records_in_file = info.st_size / (m_blocking_factor * BLOCK_SIZE);
+    if (m_backend == Backend::URING && !start_ring())
+        m_backend = Backend::STREAM;
+
+    if (m_backend == Backend::MMAP)
+    {
+        m_map_size = static_cast<std::size_t>(m_records_in_file) * m_blocking_factor * BLOCK_SIZE;
+        if (m_map_size)
+        {
+            void* address = mmap(nullptr, m_map_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+            if (address == MAP_FAILED)
+            {
+                close(m_fd);
+                std::string error_msg("Could not map file ");
+                error_msg.append(m_file_path);
+                throw std::runtime_error(error_msg);
+            }
+
+            madvise(address, m_map_size, MADV_SEQUENTIAL);
+            m_map = static_cast<const Block*>(address);
+        }
+    }
+    else
+        posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+InStream::~InStream()
+{
+    if (m_ring)
+        drain();
+
+    if (m_map)
+        munmap(const_cast<Block*>(m_map), m_map_size);
+
+    close(m_fd);
 }
 
 Status InStream::read_block(Block& raw, bool advance)
+{
+    const Block* block;
+    Status       st = view_block(block, advance);
+    if (st != Status::OK)
+        return st;
+
+    raw = *block;
+
+    return Status::OK;
+}
+
+Status InStream::view_block(const Block*& raw, bool advance)
 {
     if (m_should_read)
     {
@@ -111,355 +539,2959 @@ Status InStream::read_block(Block& raw, bool advance)
             return Status::END;
     }
 
-    raw = m_record[m_block_id];
+    if (m_map)
+        raw = m_map + m_record_id * m_blocking_factor + m_block_id;
+    else
+        raw = current_block();
 
     if (advance)
+    {
+        TAR_COUNT(BLOCKS_READ, 1);
         m_block_id++;
+    }
 
     if (m_block_id >= m_blocking_factor)
     {
-        m_block_id    = 0;
-        m_record_id   = m_stream.tellg() / (BLOCK_SIZE * m_blocking_factor);
+        m_block_id = 0;
+        m_record_id++;
         m_should_read = true;
     }
 
     return Status::OK;
 }
 
+Status InStream::read_data(std::size_t size, View& view)
+{
+    std::uint64_t blocks = size / BLOCK_SIZE;
+    if (size % BLOCK_SIZE)
+        blocks++;
+
+    if (m_map)
+    {
+        std::size_t first = static_cast<std::size_t>(m_record_id) * m_blocking_factor + m_block_id;
+        if ((first + blocks) * BLOCK_SIZE > m_map_size)
+            return Status::ERROR;
+
+        view = View(m_map[first].as_data, size);
+        TAR_COUNT(BLOCKS_READ, blocks);
+
+        return blocks ? skip_blocks(blocks) : Status::OK;
+    }
+
+    m_data.clear();
+    m_data.reserve(size);
+    for (std::uint64_t i = 0; i < blocks; ++i)
+    {
+        const Block* block;
+        if (view_block(block) != Status::OK)
+            return Status::ERROR;
+
+        std::size_t bytes_to_copy = std::min<std::size_t>(size - m_data.size(), BLOCK_SIZE);
+        m_data.insert(m_data.end(), block->as_data, block->as_data + bytes_to_copy);
+    }
+    view = m_data;
+
+    return Status::OK;
+}
+
 Status InStream::read_record()
 {
+    if (m_map)
+    {
+        TAR_COUNT(RECORDS_READ, 1);
+        m_should_read = false;
+        return Status::OK;
+    }
+
+    // Records that are already in the buffer need no I/O
+    if (m_next_record >= m_buffer_first && m_next_record - m_buffer_first < m_buffered)
+    {
+        TAR_COUNT(RECORDS_READ, 1);
+        m_buffer_record = m_next_record - m_buffer_first;
+        m_next_record++;
+        m_should_read = false;
+
+        return Status::OK;
+    }
+
     if (!m_record)
-        m_record = std::make_unique<Block[]>(m_blocking_factor);
+        m_record = make_buffer(m_records_per_buffer * m_blocking_factor);
 
-    m_stream.read(reinterpret_cast<char*>(m_record.get()),
-                  BLOCK_SIZE * m_blocking_factor);
+    if (m_ring)
+        return read_record_async();
 
-    Status st = Status::OK;
-    if (!m_stream)
-        st = Status::ERROR;
-    else if (m_stream.gcount() != BLOCK_SIZE * m_blocking_factor)
-        st = Status::END;
-    else
-        m_should_read = false;
+    std::uint8_t* data        = m_record[0].as_data;
+    std::size_t   record_size = BLOCK_SIZE * m_blocking_factor;
+    std::size_t   size        = record_size * m_records_per_buffer;
+    off_t         offset      = static_cast<off_t>(m_next_record) * record_size;
+    std::size_t   done        = 0;
+
+    // Pipes give what has arrived so far, so they stop at the first whole
+    // record instead of waiting for the buffer to fill up
+    while (done < size && (m_seekable || !done || done % record_size))
+    {
+        ssize_t bytes;
+        if (m_decoder)
+        {
+            TAR_TIME(DECOMPRESS);
+            bytes = m_decoder->read(data + done, size - done);
+        }
+        else if (!m_peek.empty())
+        {
+            bytes = std::min(m_peek.size(), size - done);
+            std::memcpy(data + done, m_peek.data(), bytes);
+            m_peek.erase(m_peek.begin(), m_peek.begin() + bytes);
+        }
+        else if (!m_seekable)
+        {
+            TAR_TIME(FILL);
+            TAR_COUNT(SYSCALLS, 1);
+            if ((bytes = read(m_fd, data + done, size - done)) < 0 && errno == EINTR)
+                continue;
+        }
+        else
+        {
+            TAR_TIME(FILL);
+            TAR_COUNT(SYSCALLS, 1);
+            if ((bytes = pread(m_fd, data + done, size - done, offset + done)) < 0 && errno == EINTR)
+                continue;
+        }
+
+        if (bytes < 0)
+            return Status::ERROR;
+        if (!bytes)
+            break;
+        done += bytes;
+    }
+    TAR_COUNT(BYTES_READ, done);
+
+    // Compressed archives and pipes are not always padded to a whole record,
+    // so a short last record of whole blocks is filled up with zeros
+    if ((m_decoder || !m_seekable) && done % record_size && done % BLOCK_SIZE == 0)
+    {
+        std::size_t padding = record_size - done % record_size;
+        std::memset(data + done, 0, padding);
+        done += padding;
+    }
+
+    if (done < record_size)
+        return Status::END;
+
+    TAR_COUNT(RECORDS_READ, 1);
+    m_buffer_first  = m_next_record;
+    m_buffered      = done / record_size;
+    m_buffer_record = 0;
+    m_next_record++;
+    m_should_read = false;
+
+    return Status::OK;
+}
+
+// Buffers are read ahead into the slots. The slot holding the wanted record
+// swaps its buffer with m_record and is reused for the buffer
+// URING_QUEUE_DEPTH ahead, so the data is never copied.
+Status InStream::read_record_async()
+{
+    TAR_TIME(FILL);
+    std::size_t record_size = BLOCK_SIZE * m_blocking_factor;
+    auto        find        = [this, record_size]()
+    {
+        return std::find_if(m_slots.begin(), m_slots.end(), [this, record_size](const RecordSlot& slot)
+                            { return slot.record_id <= m_next_record && m_next_record - slot.record_id < slot.size / record_size; });
+    };
+    auto queue = [this, record_size](RecordSlot& slot, std::uint64_t record_id)
+    {
+        slot.record_id = record_id;
+        slot.size      = std::min<std::uint64_t>(m_records_per_buffer, m_records_in_file - record_id) * record_size;
+        slot.busy      = true;
+        m_in_flight++;
+
+        return m_ring->queue_read(m_fd, slot.data.get(), slot.size, static_cast<off_t>(record_id) * record_size, &slot - m_slots.data());
+    };
+
+    auto slot = find();
+    if (slot == m_slots.end())
+    {
+        // Not read ahead(start or seek), so start over from here
+        if (drain() != Status::OK)
+            return Status::ERROR;
+
+        for (std::uint32_t i = 0; i < m_slots.size(); ++i)
+        {
+            std::uint64_t first  = m_next_record + static_cast<std::uint64_t>(i) * m_records_per_buffer;
+            m_slots[i].record_id = UINT64_MAX;
+            if (first < m_records_in_file && queue(m_slots[i], first) != Status::OK)
+                return Status::ERROR;
+        }
+
+        if (m_ring->submit() != Status::OK)
+            return Status::ERROR;
+
+        slot = find();
+        if (slot == m_slots.end())
+            return Status::END;
+    }
+
+    while (slot->busy)
+        if (complete_one() != Status::OK)
+            return Status::ERROR;
+
+    if (slot->result < 0)
+        return Status::ERROR;
+    if (slot->result != static_cast<std::int32_t>(slot->size))
+        return Status::END;
+
+    TAR_COUNT(BYTES_READ, slot->size);
+    TAR_COUNT(RECORDS_READ, 1);
+    std::swap(slot->data, m_record);
+    m_buffer_first  = slot->record_id;
+    m_buffered      = slot->size / record_size;
+    m_buffer_record = m_next_record - m_buffer_first;
+    slot->record_id = UINT64_MAX;
+
+    std::uint64_t ahead = m_buffer_first + static_cast<std::uint64_t>(m_slots.size()) * m_records_per_buffer;
+    if (ahead < m_records_in_file && (queue(*slot, ahead) != Status::OK || m_ring->submit() != Status::OK))
+        return Status::ERROR;
+
+    m_next_record++;
+    m_should_read = false;
+
+    return Status::OK;
+}
+
+Status InStream::seek_record(std::uint64_t record_id)
+{
+    if (m_map)
+    {
+        if (record_id >= m_records_in_file)
+            return Status::ERROR;
+
+        m_record_id   = record_id;
+        m_block_id    = 0;
+        m_should_read = false;
+
+        return Status::OK;
+    }
+
+    // The decoder or pipe stands at the end of the buffer. Going back before
+    // the buffer means decoding again from the start, or from the frame of
+    // the record with a seek table. Going past it means reading and
+    // dropping the buffers in between.
+    if (m_decoder || !m_seekable)
+    {
+        if (!m_frames.empty())
+        {
+            if (seek_frame(record_id) != Status::OK)
+                return Status::ERROR;
+        }
+        else if (record_id < m_buffer_first)
+        {
+            if (!m_decoder || m_decoder->rewind() != Status::OK)
+                return Status::ERROR;
+            m_buffer_first = 0;
+            m_buffered     = 0;
+        }
+
+        while (record_id - m_buffer_first >= m_buffered)
+        {
+            m_next_record = m_buffer_first + m_buffered;
+            if (read_record() != Status::OK)
+                return Status::ERROR;
+        }
+    }
+
+    // Plain archives are read with pread, so there is no offset to move
+    m_next_record = record_id;
+
+    m_record_id = record_id;
+    if (read_record() != Status::OK)
+        return Status::ERROR;
+
+    m_block_id = 0;
+
+    return Status::OK;
+}
+
+// Start decoding at the last frame that begins at or before the record,
+// unless the decoder already is between that frame and the record. Frames
+// need not start on a record, the bytes up to the next one are dropped.
+Status InStream::seek_frame(std::uint64_t record_id)
+{
+    std::uint64_t record_size = BLOCK_SIZE * m_blocking_factor;
+    auto          frame       = std::upper_bound(m_frames.begin(), m_frames.end(), record_id * record_size,
+                                                 [](std::uint64_t offset, const Frame& frame)
+                                                 { return offset < frame.uncompressed; });
+    if (frame == m_frames.begin())
+        return Status::OK;
+    --frame;
+
+    std::uint64_t position = (m_buffer_first + m_buffered) * record_size;
+    if (record_id >= m_buffer_first && frame->uncompressed <= position)
+        return Status::OK;
+
+    if (m_decoder->rewind(frame->compressed) != Status::OK)
+        return Status::ERROR;
+
+    std::uint64_t first = (frame->uncompressed + record_size - 1) / record_size;
+    Data          dropped(first * record_size - frame->uncompressed);
+    std::size_t   done = 0;
+    while (done < dropped.size())
+    {
+        TAR_TIME(DECOMPRESS);
+        ssize_t bytes = m_decoder->read(dropped.data() + done, dropped.size() - done);
+        if (bytes <= 0)
+            return Status::ERROR;
+        done += bytes;
+    }
+    m_buffer_first = first;
+    m_buffered     = 0;
+
+    return Status::OK;
+}
+
+Status InStream::skip_blocks(std::uint64_t count)
+{
+    if (m_block_id + count < m_blocking_factor)
+        m_block_id += count;
+    else
+    {
+        // go to the next record(a.k.a align the records)
+        count -= m_blocking_factor - m_block_id;
+        m_record_id += count / m_blocking_factor + 1;
+        if (seek_record(m_record_id) != Status::OK)
+            return Status::ERROR;
+
+        m_block_id = count % m_blocking_factor;
+    }
+
+    return Status::OK;
+}
+
+Status InStream::read_at(std::uint64_t offset, std::size_t size, Data& buffer, View& view)
+{
+    if (m_map)
+    {
+        if (offset + size > m_map_size)
+            return Status::ERROR;
+
+        view = View(reinterpret_cast<const std::uint8_t*>(m_map) + offset, size);
+
+        return Status::OK;
+    }
+
+    if (m_decoder || !m_seekable)
+        return Status::ERROR;
+
+    buffer.resize(size);
+    std::size_t done = 0;
+    while (done < size)
+    {
+        TAR_COUNT(SYSCALLS, 1);
+        ssize_t bytes = pread(m_fd, buffer.data() + done, size - done, offset + done);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return Status::ERROR;
+        done += bytes;
+    }
+    TAR_COUNT(BYTES_READ, size);
+    view = buffer;
+
+    return Status::OK;
+}
+
+Backend InStream::backend() { return m_backend; }
+
+Codec InStream::codec() { return m_codec; }
+
+bool InStream::seekable() { return m_seekable; }
+
+std::uint64_t InStream::record_count() { return m_records_in_file; }
+
+Parser::Parser(InStream& tar_stream)
+    : m_stream(tar_stream)
+{
+}
+
+// Records are "length keyword=value\n", where length counts the whole
+// record. An empty value removes the keyword.
+static Status parse_records(View data, std::unordered_map<std::string, std::string>& records)
+{
+    const char* text = reinterpret_cast<const char*>(data.data());
+    std::size_t left = data.size();
+    while (left)
+    {
+        std::size_t length = 0;
+        auto [end, error]  = std::from_chars(text, text + left, length);
+        if (error != std::errc() || end == text + left || *end != ' ' || length > left
+            || length < static_cast<std::size_t>(end - text) + 2 || text[length - 1] != '\n')
+            return Status::ERROR;
+
+        const char* keyword = end + 1;
+        const char* value   = std::find(keyword, text + length - 1, '=');
+        if (value == text + length - 1)
+            return Status::ERROR;
+
+        if (value + 1 == text + length - 1)
+            records.erase(std::string(keyword, value));
+        else
+            records[std::string(keyword, value)] = std::string(value + 1, text + length - 1);
+
+        text += length;
+        left -= length;
+    }
+
+    return Status::OK;
+}
+
+Status Parser::next_file(File& file)
+{
+    // Long names and extended headers come as members of their own right
+    // before the header they describe
+    const Block* block;
+    Status       st;
+    Records&     records = m_records;
+    records              = m_global_records;
+    m_long_name.clear();
+    m_long_link.clear();
+    while (true)
+    {
+        st = m_stream.view_block(block);
+        if (st != Status::OK)
+            return st;
+
+        st = check_block(*block);
+        if (st != Status::OK)
+            return st;
+
+        char typeflag = block->as_header.typeflag;
+        if (typeflag != 'L' && typeflag != 'K' && typeflag != 'x' && typeflag != 'g')
+            break;
+
+        std::uint64_t size = block->as_header.size_in_bytes();
+        View          data = unpack(size);
+        if (data.size() != size)
+            return Status::ERROR;
+
+        if (typeflag == 'L' || typeflag == 'K')
+        {
+            auto end = std::find(data.begin(), data.end(), 0);
+            (typeflag == 'L' ? m_long_name : m_long_link).assign(data.begin(), end);
+        }
+        else if (parse_records(data, typeflag == 'g' ? m_global_records : records) != Status::OK)
+        {
+            std::cerr << "Malformed extended header\n";
+            return Status::ERROR;
+        }
+        else if (typeflag == 'g')
+        {
+            // Records from an 'x' header earlier in the chain still win
+            records.insert(m_global_records.begin(), m_global_records.end());
+        }
+    }
+
+    const Header& header = block->as_header;
+    file.header          = header;
+    file.mtime_nsec      = 0;
+    file.real_size       = 0;
+    file.digest_type     = Digest::NONE;
+    file.sparse_map.clear();
+    file.digest.clear();
+    if (!m_long_name.empty())
+        file.name = m_long_name;
+    else
+    {
+        file.name.assign(header.name, strnlen(header.name, sizeof(header.name)));
+
+        // POSIX ustar keeps the start of long names in prefix
+        if (!std::memcmp(header.magic, "ustar", sizeof(header.magic)) && header.prefix[0])
+        {
+            file.name.insert(0, 1, '/');
+            file.name.insert(0, header.prefix, strnlen(header.prefix, sizeof(header.prefix)));
+        }
+    }
+
+    if (!m_long_link.empty())
+        file.link_name = m_long_link;
+    else
+        file.link_name.assign(header.linkname, strnlen(header.linkname, sizeof(header.linkname)));
+
+    for (const auto& [keyword, value] : records)
+    {
+        if (keyword == "path")
+            file.name = value;
+        else if (keyword == "linkpath")
+            file.link_name = value;
+        else if (keyword == "size")
+        {
+            std::uint64_t size;
+            if (std::from_chars(value.data(), value.data() + value.size(), size).ec != std::errc())
+                return Status::ERROR;
+            format_number(file.header.size, size);
+        }
+        else if (keyword.starts_with("TARTOOLS."))
+        {
+            Digest digest = parse_digest(std::string_view(keyword).substr(9));
+            if (digest != Digest::NONE)
+            {
+                file.digest_type = digest;
+                file.digest      = value;
+            }
+        }
+        else if (keyword == "mtime")
+        {
+            // Seconds with an optional fraction
+            std::uint64_t seconds  = 0;
+            auto [fraction, error] = std::from_chars(value.data(), value.data() + value.size(), seconds);
+            if (error != std::errc())
+                continue;
+            format_number(file.header.mtime, seconds);
+
+            std::uint32_t scale = 100000000;
+            if (fraction != value.data() + value.size() && *fraction == '.')
+                for (const char* digit = fraction + 1; digit != value.data() + value.size() && scale; ++digit, scale /= 10)
+                    file.mtime_nsec += (*digit - '0') * scale;
+        }
+    }
+
+    // Only the 1.0 sparse format is read, whose map is at the start of the
+    // data. The header has a made up name.
+    auto major = records.find("GNU.sparse.major");
+    auto minor = records.find("GNU.sparse.minor");
+    if (major != records.end())
+    {
+        auto name = records.find("GNU.sparse.name");
+        if (name != records.end())
+            file.name = name->second;
+
+        if (major->second != "1" || minor == records.end() || minor->second != "0")
+            std::cerr << file.name << " is in an unsupported sparse format, its data is left as is\n";
+        else
+        {
+            auto        real_size = records.find("GNU.sparse.realsize");
+            const char* end       = real_size != records.end() ? real_size->second.data() + real_size->second.size() : nullptr;
+            if (!end || std::from_chars(real_size->second.data(), end, file.real_size).ec != std::errc()
+                || read_sparse_map(file) != Status::OK)
+            {
+                std::cerr << "Malformed sparse member " << file.name << '\n';
+                return Status::ERROR;
+            }
+        }
+    }
+
+    file.m_block_id  = m_stream.block_id();
+    file.m_record_id = m_stream.record_id();
+    TAR_MEMBER(file.header.size_in_bytes());
+
+    return Status::OK;
+}
+
+// The map is the number of segments and then the offset and length of each,
+// all as decimal lines, padded to whole blocks. The member size is cut down
+// to the data after it.
+Status Parser::read_sparse_map(File& file)
+{
+    std::uint64_t stored = file.header.size_in_bytes();
+    std::uint64_t blocks = 0;
+    std::string   text;
+    std::size_t   position = 0;
+    auto          next     = [&](std::uint64_t& value)
+    {
+        std::size_t end;
+        while ((end = text.find('\n', position)) == std::string::npos)
+        {
+            const Block* block;
+            if (++blocks * BLOCK_SIZE > stored || m_stream.view_block(block) != Status::OK)
+                return false;
+            text.append(reinterpret_cast<const char*>(block->as_data), BLOCK_SIZE);
+        }
+
+        auto [last, error] = std::from_chars(text.data() + position, text.data() + end, value);
+        position           = end + 1;
+
+        return error == std::errc() && last == text.data() + end;
+    };
+
+    std::uint64_t count;
+    std::uint64_t data = 0;
+    if (!next(count))
+        return Status::ERROR;
+
+    for (std::uint64_t i = 0; i < count; ++i)
+    {
+        Segment segment;
+        if (!next(segment.offset) || !next(segment.length) || segment.offset + segment.length > file.real_size)
+            return Status::ERROR;
+
+        data += segment.length;
+        file.sparse_map.push_back(segment);
+    }
+
+    if (data > stored - blocks * BLOCK_SIZE)
+        return Status::ERROR;
+
+    format_number(file.header.size, stored - blocks * BLOCK_SIZE);
+
+    return Status::OK;
+}
+
+View Parser::read_file(const File& file)
+{
+    if (m_stream.seek_record(file.m_record_id) != Status::OK || m_stream.skip_blocks(file.m_block_id) != Status::OK)
+        return {};
+
+    return unpack(file.header.size_in_bytes());
+}
+
+View Parser::read_file(const Member& member)
+{
+    if (m_stream.seek_record(member.record_id) != Status::OK || m_stream.skip_blocks(member.block_id) != Status::OK)
+        return {};
+
+    return unpack(member.size);
+}
+
+Status Parser::for_each_file(const std::list<File>& files, const FileCallback& callback, std::uint32_t threads)
+{
+    if (m_stream.codec() != Codec::NONE)
+    {
+        for (const auto& file : files)
+        {
+            View data = read_file(file);
+            if (data.size() != file.header.size_in_bytes() || callback(file, data) == Status::ERROR)
+                return Status::ERROR;
+        }
+
+        return Status::OK;
+    }
+
+    // Members are handed out one at a time, so a few big ones do not keep
+    // a single thread busy while the others are idle
+    std::vector<const File*> members;
+    for (const auto& file : files)
+        members.push_back(&file);
+
+    std::atomic<std::size_t> next(0);
+    std::atomic<bool>        failed(false);
+    auto                     work = [&]()
+    {
+        Data buffer;
+        for (std::size_t i = next++; i < members.size() && !failed; i = next++)
+        {
+            const File&   file   = *members[i];
+            std::uint64_t offset = (static_cast<std::uint64_t>(file.m_record_id) * m_stream.blocking_factor() + file.m_block_id) * BLOCK_SIZE;
+            View          data;
+            if (m_stream.read_at(offset, file.header.size_in_bytes(), buffer, data) != Status::OK)
+            {
+                std::cerr << "Could not read " << file.name << '\n';
+                failed = true;
+            }
+            else if (callback(file, data) == Status::ERROR)
+                failed = true;
+        }
+    };
+
+    threads = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<std::size_t>(threads, std::max<std::size_t>(1, members.size()));
+    if (threads == 1)
+        work();
+    else
+    {
+        ThreadPool                     pool(threads);
+        std::vector<std::future<void>> workers;
+        for (std::uint32_t i = 0; i < threads; ++i)
+            workers.push_back(pool.submit(work));
+        for (auto& worker : workers)
+            worker.get();
+    }
+
+    return failed ? Status::ERROR : Status::OK;
+}
+
+// Ranges smaller than this are not worth a thread
+constexpr std::uint64_t MIN_SCAN_BLOCKS = 8192;
+
+// Members whose first block is in [begin, end)
+struct Parser::Range
+{
+    std::uint64_t begin;
+    std::uint64_t end;
+    std::uint64_t start;  // where parsing started
+    std::uint64_t stop;   // the first block after the last member
+    bool          ended;  // at the end of archive blocks
+    bool          global; // a global extended header was seen
+    Status                     status;
+    std::list<File>            files;
+    std::vector<std::uint64_t> starts;
+};
+
+// Only blocks with ustar magic are taken for headers, which every archiver
+// since POSIX.1-1988 writes. A v7 archive makes every guess fail and is
+// parsed in order.
+static bool is_header(const Block& block)
+{
+    return !std::memcmp(block.as_header.magic, "ustar", 5) && parse_number(block.as_header.chksum) == block.calculate_checksum();
+}
+
+void Parser::scan_range(Range& range, bool search)
+{
+    range.start  = range.begin;
+    range.stop   = range.begin;
+    range.ended  = false;
+    range.global = false;
+    range.status = Status::ERROR;
+    range.files.clear();
+    range.starts.clear();
+
+    // A stream of its own, so the ranges do not share a position
+    std::uint32_t bf      = m_stream.blocking_factor();
+    Backend       backend = m_stream.backend() == Backend::MMAP ? Backend::MMAP : Backend::STREAM;
+    InStream      in(m_stream.file_path(), bf, backend, m_stream.buffer_size());
+    Parser        parser(in);
+    auto          seek = [&in, bf](std::uint64_t block)
+    { return in.seek_record(block / bf) == Status::OK && in.skip_blocks(block % bf) == Status::OK; };
+
+    if (!seek(range.begin))
+        return;
+
+    if (search)
+    {
+        const Block* block;
+        while (range.start < range.end && in.view_block(block) == Status::OK && !is_header(*block))
+            range.start++;
+
+        // Inside the data of a single member
+        if (range.start >= range.end)
+        {
+            range.status = Status::OK;
+            return;
+        }
+
+        if (!seek(range.start))
+            return;
+    }
+
+    while (true)
+    {
+        std::uint64_t position = in.record_id() * bf + in.block_id();
+        range.stop             = position;
+        if (position >= range.end)
+            break;
+
+        File&  file = range.files.emplace_back();
+        Status st   = parser.next_file(file);
+        if (st == Status::END)
+        {
+            range.files.pop_back();
+            range.ended = true;
+            break;
+        }
+        if (st != Status::OK || in.skip_blocks(file.header.size_in_blocks()) != Status::OK)
+            return;
+
+        range.starts.push_back(position);
+    }
+
+    range.global = !parser.m_global_records.empty();
+    range.status = Status::OK;
+}
+
+Status Parser::scan(std::list<File>& files, std::vector<std::uint64_t>& starts, std::uint32_t threads)
+{
+    if (m_stream.codec() != Codec::NONE || !m_stream.seekable())
+        return Status::END;
+
+    std::uint64_t blocks = m_stream.record_count() * m_stream.blocking_factor();
+    threads              = std::min<std::uint64_t>(threads, blocks / MIN_SCAN_BLOCKS);
+    if (threads < 2)
+        return Status::END;
+
+    std::vector<Range> ranges(threads);
+    std::uint64_t      length = (blocks + threads - 1) / threads;
+    {
+        ThreadPool                     pool(threads);
+        std::vector<std::future<void>> workers;
+        for (std::uint32_t i = 0; i < threads; ++i)
+        {
+            ranges[i].begin = i * length;
+            ranges[i].end   = std::min(blocks, (i + 1) * length);
+            workers.push_back(pool.submit([this, &range = ranges[i], i]()
+                                          { scan_range(range, i > 0); }));
+        }
+        for (auto& worker : workers)
+            worker.get();
+    }
+
+    // Follow the true chain of headers through the ranges. Ranges that the
+    // member before them covers entirely have nothing in them.
+    files.clear();
+    starts.clear();
+    std::uint64_t position = 0;
+    for (auto& range : ranges)
+    {
+        if (position >= range.end)
+            continue;
+
+        if (range.status != Status::OK || range.start != position)
+        {
+            range.begin = position;
+            scan_range(range, false);
+            if (range.status != Status::OK)
+                return Status::ERROR;
+        }
+
+        // Global records apply to every member after them, which the ranges
+        // after this one did not know about
+        if (range.global)
+            return Status::END;
+
+        files.splice(files.end(), range.files);
+        starts.insert(starts.end(), range.starts.begin(), range.starts.end());
+        position = range.stop;
+        if (range.ended)
+            break;
+    }
+
+    return Status::OK;
+}
+
+Status Parser::list_files(std::list<File>& list, const Matcher* matcher, std::uint32_t threads)
+{
+    list.clear();
+    threads = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+    if (threads > 1)
+    {
+        std::vector<std::uint64_t> starts;
+        Status                     st = scan(list, starts, threads);
+        if (st == Status::ERROR)
+            return st;
+
+        if (st == Status::OK)
+        {
+            if (matcher)
+                list.remove_if([matcher](const File& file)
+                               { return !matcher->selects(file.name); });
+
+            return Status::OK;
+        }
+    }
+
+    m_stream.seek_record(0);
+    Status st;
+
+    do
+    {
+        File file;
+        st = next_file(file);
+        if (st != Status::OK)
+            break;
+
+        std::uint64_t data_blocks = file.header.size_in_blocks();
+        st                        = m_stream.skip_blocks(data_blocks);
+        if (st != Status::OK)
+            break;
+
+        if (!matcher || matcher->selects(file.name))
+            list.push_back(file);
+    } while (st == Status::OK);
+
+    if (st == Status::ERROR)
+        return st;
+
+    return Status::OK;
+}
+
+// One File is reused for every member, so its strings keep their buffers
+// and the names are only copied into the pool
+Status Parser::list_members(Listing& listing, const Matcher* matcher)
+{
+    listing.members.clear();
+    listing.names.clear();
+    if (m_stream.seek_record(0) != Status::OK)
+        return Status::ERROR;
+
+    File   file;
+    Status st;
+    while ((st = next_file(file)) == Status::OK)
+    {
+        const Header& header = file.header;
+        if (matcher && !matcher->selects(file.name))
+        {
+            if (m_stream.skip_blocks(header.size_in_blocks()) != Status::OK)
+                return Status::ERROR;
+            continue;
+        }
+
+        Member member;
+        member.record_id   = file.m_record_id;
+        member.block_id    = file.m_block_id;
+        member.size        = header.size_in_bytes();
+        member.mtime       = parse_number(header.mtime);
+        member.mode        = parse_number(header.mode);
+        member.uid         = parse_number(header.uid);
+        member.gid         = parse_number(header.gid);
+        member.typeflag    = header.typeflag;
+        member.name        = listing.names.size();
+        member.name_length = file.name.size();
+        member.link_length = file.link_name.size();
+        listing.names += file.name;
+        listing.names += file.link_name;
+        listing.members.push_back(member);
+
+        if (m_stream.skip_blocks(header.size_in_blocks()) != Status::OK)
+            return Status::ERROR;
+    }
+
+    return st == Status::END ? Status::OK : Status::ERROR;
+}
+
+Status Parser::end_of_archive(std::uint64_t& block)
+{
+    if (m_stream.seek_record(0) != Status::OK)
+        return Status::ERROR;
+
+    File   file;
+    Status st;
+    block = 0;
+    while ((st = next_file(file)) == Status::OK)
+    {
+        std::uint64_t data_blocks = file.header.size_in_blocks();
+        if (m_stream.skip_blocks(data_blocks) != Status::OK)
+            return Status::ERROR;
+
+        block = static_cast<std::uint64_t>(file.m_record_id) * m_stream.blocking_factor() + file.m_block_id + data_blocks;
+    }
+
+    return st == Status::END ? Status::OK : Status::ERROR;
+}
+
+static IndexEntry index_entry(std::uint64_t record_id, std::uint32_t block_id, const File& file)
+{
+    IndexEntry entry;
+    std::memset(&entry, 0, sizeof(entry));
+    entry.record_id = record_id;
+    entry.block_id  = block_id;
+    entry.name_hash = Parser::hash_name(file.name);
+    entry.size      = file.header.size_in_bytes();
+    entry.mtime     = parse_number(file.header.mtime);
+    entry.typeflag  = file.header.typeflag;
+
+    return entry;
+}
+
+Status Parser::write_index(const fs::path& index_path, std::uint32_t threads)
+{
+    std::vector<IndexEntry>    index;
+    std::list<File>            files;
+    std::vector<std::uint64_t> starts;
+    Status                     st = Status::END;
+
+    threads = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+    if (threads > 1)
+        st = scan(files, starts, threads);
+    if (st == Status::ERROR)
+        return st;
+
+    std::uint32_t bf = m_stream.blocking_factor();
+    if (st == Status::OK)
+    {
+        auto start = starts.begin();
+        for (const auto& file : files)
+        {
+            index.push_back(index_entry(*start / bf, *start % bf, file));
+            ++start;
+        }
+    }
+    else
+    {
+        if (m_stream.seek_record(0) != Status::OK)
+            return Status::ERROR;
+
+        do
+        {
+            std::uint64_t record_id = m_stream.record_id();
+            std::uint32_t block_id  = m_stream.block_id();
+
+            File file;
+            st = next_file(file);
+            if (st != Status::OK)
+                break;
+
+            st = m_stream.skip_blocks(file.header.size_in_blocks());
+            if (st != Status::OK)
+                break;
+
+            index.push_back(index_entry(record_id, block_id, file));
+        } while (st == Status::OK);
+
+        if (st == Status::ERROR)
+            return st;
+    }
+
+    std::stable_sort(index.begin(), index.end(), [](const IndexEntry& a, const IndexEntry& b)
+                     { return a.name_hash < b.name_hash; });
+
+    IndexHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.blocking_factor = m_stream.blocking_factor();
+    header.count           = index.size();
+
+    std::ofstream out(index_path, std::ios::out | std::ios::binary);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(IndexEntry));
+    if (!out)
+        return Status::ERROR;
+
+    m_index = std::move(index);
+
+    return Status::OK;
+}
+
+Status Parser::load_index(const fs::path& index_path)
+{
+    std::ifstream in(index_path, std::ios::in | std::ios::binary);
+    IndexHeader   header;
+
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!in || std::memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)))
+    {
+        std::cerr << index_path << " is not an index file\n";
+        return Status::ERROR;
+    }
+
+    if (header.blocking_factor != m_stream.blocking_factor())
+    {
+        std::cerr << index_path << " was written with a different blocking factor\n";
+        return Status::ERROR;
+    }
+
+    std::vector<IndexEntry> index(header.count);
+    in.read(reinterpret_cast<char*>(index.data()), index.size() * sizeof(IndexEntry));
+    if (!in)
+        return Status::ERROR;
+
+    m_index = std::move(index);
+
+    return Status::OK;
+}
+
+Status Parser::find(const std::string& name, File& file)
+{
+    if (m_index.empty())
+    {
+        if (m_stream.seek_record(0) != Status::OK)
+            return Status::ERROR;
+
+        Status st;
+        while ((st = next_file(file)) == Status::OK)
+        {
+            if (file.name == name)
+                return Status::OK;
+
+            st = m_stream.skip_blocks(file.header.size_in_blocks());
+            if (st != Status::OK)
+                break;
+        }
+
+        return st == Status::ERROR ? st : Status::END;
+    }
+
+    std::uint64_t hash  = hash_name(name);
+    auto          range = std::equal_range(m_index.begin(), m_index.end(), IndexEntry { hash, 0, 0, 0, {}, 0, 0 },
+                                           [](const IndexEntry& a, const IndexEntry& b)
+                                           { return a.name_hash < b.name_hash; });
+
+    // Hash collisions are resolved by comparing the name stored in the archive
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        if (m_stream.seek_record(it->record_id) != Status::OK
+            || m_stream.skip_blocks(it->block_id) != Status::OK
+            || next_file(file) != Status::OK)
+            return Status::ERROR;
+
+        if (file.name == name)
+            return Status::OK;
+    }
+
+    return Status::END;
+}
+
+std::uint64_t Parser::hash_name(const std::string& name)
+{
+    // 64 bit FNV-1a
+    std::uint64_t hash = 0xcbf29ce484222325;
+    for (unsigned char c : name)
+    {
+        hash ^= c;
+        hash *= 0x100000001b3;
+    }
+
+    return hash;
+}
+
+// Member data is handed to the writer threads and to stream callbacks in
+// chunks of this size
+constexpr std::size_t DATA_CHUNK = 1024 * 1024;
+
+// A regular file being extracted. Its mode and mtime are restored when the
+// last chunk that refers to it has been written.
+struct ExtractedFile
+{
+    ExtractedFile(int fd, const fs::path& path, mode_t mode, struct timespec mtime)
+        : fd(fd)
+        , path(path)
+        , mode(mode)
+        , mtime(mtime)
+    {
+    }
+
+    ~ExtractedFile()
+    {
+        struct timespec times[2] = { { 0, UTIME_OMIT }, mtime };
+        if (fchmod(fd, mode) < 0 || futimens(fd, times) < 0)
+            std::cerr << "Could not restore the attributes of " << path << '\n';
+        close(fd);
+    }
+
+    int             fd;
+    fs::path        path;
+    mode_t          mode;
+    struct timespec mtime;
+};
+
+static struct timespec member_mtime(const File& file)
+{
+    return { static_cast<time_t>(parse_number(file.header.mtime)), static_cast<long>(file.mtime_nsec) };
+}
+
+static Status write_chunk(int fd, View data, off_t offset)
+{
+    std::size_t done = 0;
+    while (done < data.size())
+    {
+        TAR_COUNT(SYSCALLS, 1);
+        ssize_t bytes = pwrite(fd, data.data() + done, data.size() - done, offset + done);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return Status::ERROR;
+        done += bytes;
+    }
+
+    return Status::OK;
+}
+
+// Place a member name below dest, refusing names that would escape it
+static bool member_path(const fs::path& dest, const std::string& name, fs::path& path)
+{
+    fs::path relative = fs::path(name).relative_path();
+    if (relative.empty())
+        return false;
+
+    for (const auto& part : relative)
+        if (part == "..")
+            return false;
+
+    path = dest / relative;
+
+    return true;
+}
+
+Status Parser::extract_all(const fs::path& dest, std::uint32_t threads, const Matcher* matcher)
+{
+    if (m_stream.seek_record(0) != Status::OK)
+        return Status::ERROR;
+
+    // Views into a mapping stay valid, record buffers have to be copied
+    // before they are handed to another thread
+    bool                            parallel = threads > 1;
+    bool                            mapped   = m_stream.backend() == Backend::MMAP;
+    std::unique_ptr<ThreadPool>     pool(parallel ? new ThreadPool(threads) : nullptr);
+    std::size_t                     window = 4 * threads;
+    std::deque<std::future<Status>> in_flight;
+    auto                            wait = [&in_flight](std::size_t limit)
+    {
+        Status st = Status::OK;
+        while (in_flight.size() > limit)
+        {
+            if (in_flight.front().get() != Status::OK)
+                st = Status::ERROR;
+            in_flight.pop_front();
+        }
+
+        return st;
+    };
+
+    // Directory attributes are restored last, deepest first, since creating
+    // their contents changes their mtime. Symbolic links are created last so
+    // that no member is written through one.
+    std::vector<std::pair<fs::path, File>> directories;
+    std::vector<std::pair<fs::path, File>> symlinks;
+
+    File   file;
+    Status st;
+    while ((st = next_file(file)) == Status::OK)
+    {
+        const Header& header = file.header;
+        fs::path      path;
+        if (matcher && !matcher->selects(file.name))
+        {
+            st = m_stream.skip_blocks(header.size_in_blocks());
+            if (st != Status::OK)
+                break;
+            continue;
+        }
+
+        if (!member_path(dest, file.name, path))
+        {
+            std::cerr << "Skipping " << file.name << '\n';
+            st = m_stream.skip_blocks(header.size_in_blocks());
+            if (st != Status::OK)
+                break;
+            continue;
+        }
+
+        std::error_code error;
+        fs::create_directories(path.parent_path(), error);
+        if (error)
+        {
+            std::cerr << "Could not create " << path.parent_path() << ": " << error.message() << '\n';
+            st = Status::ERROR;
+            break;
+        }
+
+        mode_t          mode  = parse_number(header.mode);
+        struct timespec mtime = member_mtime(file);
+
+        switch (header.typeflag)
+        {
+        case '0':
+        case '\0':
+        case '7':
+        {
+            unlink(path.c_str());
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            if (fd < 0)
+            {
+                std::cerr << "Could not create " << path << '\n';
+                wait(0);
+                return Status::ERROR;
+            }
+
+            // Sparse members keep their segments back to back and only those
+            // are written, the holes come from the size of the file. Other
+            // files are a single segment.
+            std::size_t              size  = header.size_in_bytes();
+            Segment                  whole = { 0, size };
+            std::span<const Segment> segments(&whole, 1);
+            if (!file.sparse_map.empty())
+            {
+                segments = file.sparse_map;
+                if (ftruncate(fd, file.real_size) < 0)
+                    st = Status::ERROR;
+            }
+            else if (size)
+                fallocate(fd, 0, 0, size);
+
+            // Digests are checked on the chunks as they are read, before
+            // they go to the writers
+            auto          target  = std::make_shared<ExtractedFile>(fd, path, mode, mtime);
+            auto          hasher  = file.sparse_map.empty() ? make_hasher(file.digest_type) : nullptr;
+            std::size_t   segment = 0;
+            std::uint64_t done    = 0; // of the current segment
+            for (std::size_t offset = 0; offset < size; offset += DATA_CHUNK)
+            {
+                View chunk;
+                if (m_stream.read_data(std::min(DATA_CHUNK, size - offset), chunk) != Status::OK)
+                {
+                    std::cerr << "Could not read " << file.name << '\n';
+                    wait(0);
+                    return Status::ERROR;
+                }
+                if (hasher)
+                    hasher->update(chunk);
+
+                while (!chunk.empty() && segment < segments.size())
+                {
+                    std::size_t length = std::min<std::uint64_t>(chunk.size(), segments[segment].length - done);
+                    View        data   = chunk.first(length);
+                    off_t       at     = segments[segment].offset + done;
+                    chunk              = chunk.subspan(length);
+                    done += length;
+                    if (done == segments[segment].length)
+                    {
+                        segment++;
+                        done = 0;
+                    }
+
+                    if (data.empty())
+                        continue;
+
+                    if (!parallel)
+                    {
+                        if (write_chunk(fd, data, at) != Status::OK)
+                            st = Status::ERROR;
+                        continue;
+                    }
+
+                    if (wait(window) != Status::OK)
+                        st = Status::ERROR;
+
+                    if (mapped)
+                        in_flight.push_back(pool->submit([target, data, at]()
+                                                         { return write_chunk(target->fd, data, at); }));
+                    else
+                        in_flight.push_back(pool->submit([target, copy = Data(data.begin(), data.end()), at]()
+                                                         { return write_chunk(target->fd, copy, at); }));
+                }
+            }
+
+            if (hasher && hasher->finish() != file.digest)
+            {
+                std::cerr << "The " << digest_name(file.digest_type) << " digest of " << file.name << " does not match\n";
+                st = Status::ERROR;
+            }
+            break;
+        }
+        case '1':
+        {
+            fs::path target;
+            if (!member_path(dest, file.link_name, target))
+            {
+                std::cerr << "Skipping " << file.name << '\n';
+                break;
+            }
+
+            unlink(path.c_str());
+            if (link(target.c_str(), path.c_str()) < 0)
+                st = Status::ERROR;
+            break;
+        }
+        case '2':
+            symlinks.emplace_back(path, file);
+            break;
+        case '3':
+        case '4':
+        case '6':
+        {
+            mode_t type = header.typeflag == '3' ? S_IFCHR : header.typeflag == '4' ? S_IFBLK
+                                                                                      : S_IFIFO;
+            dev_t device = 0;
+            if (type != S_IFIFO)
+                device = makedev(parse_number(header.devmajor), parse_number(header.devminor));
+
+            struct timespec times[2] = { { 0, UTIME_OMIT }, mtime };
+
+            unlink(path.c_str());
+            if (mknod(path.c_str(), type | mode, device) < 0)
+                st = Status::ERROR;
+            else if (chmod(path.c_str(), mode) < 0 || utimensat(AT_FDCWD, path.c_str(), times, 0) < 0)
+                std::cerr << "Could not restore the attributes of " << path << '\n';
+            break;
+        }
+        case '5':
+            fs::create_directories(path, error);
+            if (error)
+                st = Status::ERROR;
+            else
+                directories.emplace_back(path, file);
+            break;
+        default:
+            std::cerr << "Skipping " << file.name << " of unsupported type " << header.typeflag << '\n';
+            break;
+        }
+
+        if (st != Status::OK)
+        {
+            std::cerr << "Could not extract " << file.name << '\n';
+            break;
+        }
+
+        // Data of anything that was not a regular file
+        if (header.typeflag != '0' && header.typeflag != '\0' && header.typeflag != '7')
+        {
+            st = m_stream.skip_blocks(header.size_in_blocks());
+            if (st != Status::OK)
+                break;
+        }
+    }
+
+    if (wait(0) != Status::OK || st == Status::ERROR)
+        return Status::ERROR;
+
+    for (const auto& [path, link] : symlinks)
+    {
+        struct timespec times[2] = { { 0, UTIME_OMIT }, member_mtime(link) };
+
+        unlink(path.c_str());
+        if (symlink(link.link_name.c_str(), path.c_str()) < 0)
+        {
+            std::cerr << "Could not extract " << path << '\n';
+            return Status::ERROR;
+        }
+        utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+    }
+
+    for (auto it = directories.rbegin(); it != directories.rend(); ++it)
+    {
+        const auto& [path, directory] = *it;
+        struct timespec times[2]      = { { 0, UTIME_OMIT }, member_mtime(directory) };
+
+        if (chmod(path.c_str(), parse_number(directory.header.mode)) < 0
+            || utimensat(AT_FDCWD, path.c_str(), times, 0) < 0)
+            std::cerr << "Could not restore the attributes of " << path << '\n';
+    }
+
+    return Status::OK;
+}
+
+Status Parser::stream(const ChunkCallback& callback, const MemberFilter& filter)
+{
+    File   file;
+    Status st;
+    while ((st = next_file(file)) == Status::OK)
+    {
+        // Skipping reads forward and drops the data if the stream can not seek
+        if (filter && !filter(file))
+        {
+            if (m_stream.skip_blocks(file.header.size_in_blocks()) != Status::OK)
+                return Status::ERROR;
+            continue;
+        }
+
+        std::uint64_t size = file.header.size_in_bytes();
+        for (std::uint64_t offset = 0; offset < size; offset += DATA_CHUNK)
+        {
+            View chunk;
+            if (m_stream.read_data(std::min<std::uint64_t>(DATA_CHUNK, size - offset), chunk) != Status::OK)
+            {
+                std::cerr << "Could not read " << file.name << '\n';
+                return Status::ERROR;
+            }
+
+            if (callback(file, offset, chunk) != Status::OK)
+                return Status::ERROR;
+        }
+    }
+
+    return st == Status::END ? Status::OK : Status::ERROR;
+}
+
+Status Parser::check_digests(std::uint64_t& checked, std::uint64_t& failed, const Manifest* manifest, Digest digest)
+{
+    checked = 0;
+    failed  = 0;
+    if (m_stream.seekable() && m_stream.seek_record(0) != Status::OK)
+        return Status::ERROR;
+
+    std::unique_ptr<Hasher>         hasher;
+    Digest                          kind = Digest::NONE;
+    std::string                     expected;
+    std::unordered_set<std::string> seen;
+    auto                            finish = [&](const File& file)
+    {
+        checked++;
+        if (hasher->finish() != expected)
+        {
+            std::cerr << "The " << digest_name(kind) << " digest of " << file.name << " does not match\n";
+            failed++;
+        }
+        hasher.reset();
+    };
+
+    // Picks the members to hash, members without data are done right away
+    auto select = [&](const File& file)
+    {
+        char type = file.header.typeflag;
+        if ((type != '0' && type != '\0' && type != '7') || !file.sparse_map.empty())
+            return false;
+
+        if (manifest)
+        {
+            auto found = manifest->find(file.name);
+            if (found == manifest->end())
+                return false;
+            seen.insert(file.name);
+            kind     = digest;
+            expected = found->second;
+        }
+        else
+        {
+            kind     = file.digest_type;
+            expected = file.digest;
+        }
+
+        hasher = make_hasher(kind);
+
+        if (!hasher)
+            return false;
+        if (file.header.size_in_bytes())
+            return true;
+
+        finish(file);
+        return false;
+    };
+
+    auto check = [&](const File& file, std::uint64_t offset, View chunk)
+    {
+        hasher->update(chunk);
+        if (offset + chunk.size() == file.header.size_in_bytes())
+            finish(file);
+
+        return Status::OK;
+    };
+
+    if (stream(check, select) != Status::OK)
+        return Status::ERROR;
+
+    if (manifest)
+    {
+        for (const auto& [name, value] : *manifest)
+        {
+            if (seen.count(name))
+                continue;
+            std::cerr << name << " is not in the archive\n";
+            failed++;
+        }
+    }
+
+    return Status::OK;
+}
+
+Status Parser::check_block(const Block& block)
+{
+    if (block.is_zero_block())
+    {
+        const Block* next;
+        if (m_stream.view_block(next, false) != Status::OK || next->is_zero_block())
+            return Status::END;
+        else
+            return Status::ERROR;
+    }
+
+    std::uint32_t sum;
+    {
+        TAR_TIME(CHECKSUM);
+        sum = block.calculate_checksum();
+    }
+
+    std::uint32_t header_sum = parse_number(block.as_header.chksum);
+    if (sum != header_sum)
+    {
+        std::cerr << "Not matching checksums!\n";
+        return Status::ERROR;
+    }
+
+    return Status::OK;
+}
+
+View Parser::unpack(std::uint64_t size)
+{
+    View bytes;
+    if (m_stream.read_data(size, bytes) != Status::OK)
+        return {};
+
+    return bytes;
+}
+
+OutStream::OutStream(const std::string& file_path,
+                     std::uint32_t      blocking_factor,
+                     Codec              codec,
+                     std::uint32_t      threads,
+                     Backend            backend,
+                     std::size_t        buffer_size,
+                     bool               direct,
+                     bool               append,
+                     bool               seekable)
+    : BlockStream(file_path, blocking_factor, buffer_size)
+    , m_copy_method(CopyMethod::READ_WRITE)
+    , m_direct(direct && codec == Codec::NONE && !append) // appending starts at an unaligned offset
+    , m_append(append)
+    , m_written(0)
+    , m_offset(0)
+    , m_seekable(seekable)
+    , m_close_status(Status::OK)
+{
+    // Checked before the file is opened, which truncates it
+    if (m_append && codec != Codec::NONE)
+        throw std::runtime_error("Can not append to a compressed archive");
+    if (seekable && codec != Codec::ZSTD)
+        throw std::runtime_error("Only zstd archives can be seekable");
+    if (!codec_available(codec))
+        throw std::runtime_error(std::string(codec == Codec::GZIP ? "gzip" : "zstd") + " support was not compiled in");
+
+    // The start of the last record is read back when appending
+    int flags = m_append ? O_RDWR | O_CREAT | O_CLOEXEC : O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    if (m_direct)
+    {
+        m_fd = open(m_file_path.c_str(), flags | O_DIRECT, 0666);
+        if (m_fd < 0 && errno == EINVAL)
+        {
+            std::cerr << "O_DIRECT is not supported for " << file_path << ", using the page cache\n";
+            m_direct = false;
+        }
+    }
+
+    if (!m_direct)
+        m_fd = open(m_file_path.c_str(), flags, 0666);
+    if (m_fd < 0)
+    {
+        std::string error_msg("Could not open file ");
+        error_msg.append(file_path);
+        throw std::runtime_error(error_msg);
+    }
+
+    try
+    {
+        m_encoder = make_encoder(codec, m_fd, threads, seekable);
+        if (m_append)
+            find_end();
+    }
+    catch (...)
+    {
+        ::close(m_fd);
+        throw;
+    }
+
+    // The kernel can only copy member data straight into uncompressed
+    // regular files. Those copies go through the page cache, so O_DIRECT
+    // archives take the data through the buffer instead.
+    struct stat info;
+    if (!m_encoder && !m_direct && fstat(m_fd, &info) == 0 && S_ISREG(info.st_mode))
+        m_copy_method = CopyMethod::COPY_FILE_RANGE;
+
+    // Whole buffers have to be page multiples for O_DIRECT
+    if (m_direct)
+    {
+        std::size_t record_size = BLOCK_SIZE * m_blocking_factor;
+        std::size_t unit        = std::lcm(record_size, DIRECT_ALIGNMENT) / record_size;
+        m_records_per_buffer    = (m_records_per_buffer + unit - 1) / unit * unit;
+    }
+
+    if (backend == Backend::URING && !m_encoder)
+        start_ring();
+}
+
+OutStream::~OutStream()
+{
+    close();
+}
+
+Status OutStream::close()
+{
+    if (m_fd < 0)
+        return m_close_status;
+
+    Status st = Status::OK;
+    if ((m_buffer_record != 0 || m_block_id != 0) && flush_record() != Status::OK)
+        st = Status::ERROR;
+
+    // Failed writes of the ring only show up once they complete
+    if (m_ring && (drain() != Status::OK || m_io_error))
+        st = Status::ERROR;
+
+    if (m_encoder && m_encoder->finish() != Status::OK)
+        st = Status::ERROR;
+
+    // Whatever followed the old end of the archive is not part of it anymore
+    if (m_append && ftruncate(m_fd, m_offset) < 0)
+    {
+        std::cerr << "Could not truncate " << m_file_path << '\n';
+        st = Status::ERROR;
+    }
+
+    if (::close(m_fd) < 0)
+        st = Status::ERROR;
+    m_fd           = -1;
+    m_close_status = st;
+
+    return st;
+}
+
+// Put the stream on the end of archive blocks of the existing archive. Whole
+// records are written, so the blocks before them in their record are read
+// back into the buffer.
+void OutStream::find_end()
+{
+    struct stat info;
+    if (fstat(m_fd, &info) < 0 || !S_ISREG(info.st_mode))
+        throw std::runtime_error("Can only append to regular files");
+
+    if (info.st_size == 0)
+        return;
+
+    std::uint64_t end;
+    {
+        InStream in(m_file_path, m_blocking_factor);
+        Parser   parser(in);
+        if (in.codec() != Codec::NONE)
+            throw std::runtime_error("Can not append to a compressed archive");
+
+        if (parser.end_of_archive(end) != Status::OK)
+            throw std::runtime_error(m_file_path.string() + " is not a valid archive");
+    }
+
+    m_record_id = end / m_blocking_factor;
+    m_block_id  = end % m_blocking_factor;
+    m_offset    = static_cast<std::uint64_t>(m_record_id) * m_blocking_factor * BLOCK_SIZE;
+    m_record    = make_buffer(m_records_per_buffer * m_blocking_factor);
+
+    char*       data = reinterpret_cast<char*>(m_record.get());
+    std::size_t size = m_block_id * BLOCK_SIZE;
+    std::size_t done = 0;
+    while (done < size)
+    {
+        ssize_t bytes = pread(m_fd, data + done, size - done, m_offset + done);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            throw std::runtime_error("Could not read " + m_file_path.string());
+        done += bytes;
+    }
+
+    if (lseek(m_fd, m_offset, SEEK_SET) < 0)
+        throw std::runtime_error("Could not seek in " + m_file_path.string());
+}
+
+Status OutStream::write_block(const Block& block)
+{
+    if (next_block() != Status::OK)
+        return Status::ERROR;
+
+    *current_block() = block;
+    advance(1);
+
+    return Status::OK;
+}
+
+Status OutStream::write_blocks(const std::vector<Block>& blocks)
+{
+    for (const auto& block : blocks)
+        if (write_block(block) != Status::OK)
+            return Status::ERROR;
+
+    return Status::OK;
+}
+
+Status OutStream::write_data(int fd, std::size_t size, Hasher* digest)
+{
+    if (!digest && m_copy_method != CopyMethod::READ_WRITE && size >= BLOCK_SIZE)
+    {
+        std::size_t whole_blocks = size / BLOCK_SIZE * BLOCK_SIZE;
+        Status      st           = copy_blocks(fd, whole_blocks);
+        if (st == Status::ERROR)
+            return st;
+
+        if (st == Status::OK)
+            size -= whole_blocks;
+    }
+
+    while (size > 0)
+    {
+        if (next_block() != Status::OK)
+            return Status::ERROR;
+
+        // Fill the rest of the buffer directly from the file
+        std::size_t   room  = ((m_records_per_buffer - m_buffer_record) * m_blocking_factor - m_block_id) * BLOCK_SIZE;
+        std::size_t   chunk = std::min(room, size);
+        std::uint8_t* dest  = current_block()->as_data;
+        std::size_t   done  = 0;
+
+        TAR_TIME(READ);
+        while (done < chunk)
+        {
+            TAR_COUNT(SYSCALLS, 1);
+            ssize_t bytes = read(fd, dest + done, chunk - done);
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            if (bytes <= 0)
+                return Status::ERROR;
+            done += bytes;
+        }
+
+        if (digest)
+            digest->update(View(dest, chunk));
+
+        std::size_t blocks = chunk / BLOCK_SIZE;
+        if (chunk % BLOCK_SIZE)
+        {
+            std::memset(dest + chunk, 0, BLOCK_SIZE - chunk % BLOCK_SIZE);
+            blocks++;
+        }
+
+        advance(blocks);
+        size -= chunk;
+    }
+
+    return Status::OK;
+}
+
+Status OutStream::write_data(View data)
+{
+    while (!data.empty())
+    {
+        if (next_block() != Status::OK)
+            return Status::ERROR;
+
+        std::size_t   room  = ((m_records_per_buffer - m_buffer_record) * m_blocking_factor - m_block_id) * BLOCK_SIZE;
+        std::size_t   chunk = std::min(room, data.size());
+        std::uint8_t* dest  = current_block()->as_data;
+
+        std::memcpy(dest, data.data(), chunk);
+
+        std::size_t blocks = chunk / BLOCK_SIZE;
+        if (chunk % BLOCK_SIZE)
+        {
+            std::memset(dest + chunk, 0, BLOCK_SIZE - chunk % BLOCK_SIZE);
+            blocks++;
+        }
+
+        advance(blocks);
+        data = data.subspan(chunk);
+    }
+
+    return Status::OK;
+}
+
+// Returns END without having copied anything if the kernel can not do the
+// copy, so the caller can fall back to the record buffer.
+Status OutStream::copy_blocks(int fd, std::size_t size)
+{
+    if (next_block() != Status::OK || write_pending() != Status::OK)
+        return Status::ERROR;
+
+    // Writes through the ring do not move the file offset
+    if (m_ring && lseek(m_fd, m_offset, SEEK_SET) < 0)
+        return Status::ERROR;
+
+    TAR_TIME(COPY);
+    std::size_t done = 0;
+    while (done < size)
+    {
+        TAR_COUNT(SYSCALLS, 1);
+        ssize_t bytes;
+        if (m_copy_method == CopyMethod::COPY_FILE_RANGE)
+            bytes = copy_file_range(fd, nullptr, m_fd, nullptr, size - done, 0);
+        else
+            bytes = sendfile(m_fd, fd, nullptr, size - done);
+
+        if (bytes < 0 && errno == EINTR)
+            continue;
+
+        if (bytes < 0 && !done
+            && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF))
+        {
+            if (m_copy_method == CopyMethod::COPY_FILE_RANGE)
+                m_copy_method = CopyMethod::SENDFILE;
+            else
+            {
+                m_copy_method = CopyMethod::READ_WRITE;
+                return Status::END;
+            }
+            continue;
+        }
+
+        // The file shrank or the copy failed half way
+        if (bytes <= 0)
+            return Status::ERROR;
+
+        done += bytes;
+    }
+
+    m_offset += size;
+    TAR_COUNT(BYTES_WRITTEN, size);
+
+    // The copied blocks never were in the buffer, so it starts over with
+    // the current record
+    advance(size / BLOCK_SIZE);
+    m_buffer_record = 0;
+    m_written       = m_block_id;
+
+    return Status::OK;
+}
+
+// Write the filled blocks of the buffer that are not in the file yet. With
+// io_uring and rotate set, the write is left in flight and m_record is
+// replaced by a free buffer, otherwise it is waited for.
+Status OutStream::write_pending(bool rotate)
+{
+    const char* data = reinterpret_cast<const char*>(m_record.get() + m_written);
+    std::size_t size = (m_buffer_record * m_blocking_factor + m_block_id - m_written) * BLOCK_SIZE;
+    std::size_t done = 0;
+
+    // Only the end of the archive can be a partial buffer, which O_DIRECT
+    // would refuse
+    if (m_direct && (size % DIRECT_ALIGNMENT || m_offset % DIRECT_ALIGNMENT || m_written * BLOCK_SIZE % DIRECT_ALIGNMENT))
+    {
+        if (fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) & ~O_DIRECT) < 0)
+            return Status::ERROR;
+        m_direct = false;
+    }
+
+    TAR_COUNT(BYTES_WRITTEN, size);
+    if (m_ring)
+    {
+        TAR_TIME(WRITE);
+        auto slot = std::find_if(m_slots.begin(), m_slots.end(), [](const RecordSlot& slot)
+                                 { return !slot.busy; });
+        while (slot == m_slots.end())
+        {
+            if (complete_one() != Status::OK)
+                return Status::ERROR;
+            slot = std::find_if(m_slots.begin(), m_slots.end(), [](const RecordSlot& slot)
+                                { return !slot.busy; });
+        }
+
+        if (rotate)
+            std::swap(slot->data, m_record);
+
+        slot->size = size;
+        slot->busy = true;
+        m_in_flight++;
+        if (m_ring->queue_write(m_fd, data, size, m_offset, slot - m_slots.begin()) != Status::OK
+            || m_ring->submit() != Status::OK)
+            return Status::ERROR;
+
+        m_offset += size;
+        m_written = m_buffer_record * m_blocking_factor + m_block_id;
+        if (!rotate && drain() != Status::OK)
+            return Status::ERROR;
+
+        return m_io_error ? Status::ERROR : Status::OK;
+    }
+
+    if (m_encoder)
+    {
+        TAR_TIME(COMPRESS);
+        if (m_encoder->write(reinterpret_cast<const std::uint8_t*>(data), size) != Status::OK)
+            return Status::ERROR;
+    }
+
+    TAR_TIME(WRITE);
+    while (!m_encoder && done < size)
+    {
+        TAR_COUNT(SYSCALLS, 1);
+        ssize_t bytes = write(m_fd, data + done, size - done);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return Status::ERROR;
+        done += bytes;
+    }
+    m_offset += size;
+    m_written = m_buffer_record * m_blocking_factor + m_block_id;
+
+    return Status::OK;
+}
+
+Status OutStream::member_boundary()
+{
+    if (!m_seekable)
+        return Status::OK;
+
+    std::uint64_t pending = (m_buffer_record * m_blocking_factor + m_block_id - m_written) * BLOCK_SIZE;
+    if (m_encoder->frame_size() + pending < FRAME_SIZE)
+        return Status::OK;
+
+    // Everything before the member goes in the frame that ends
+    if (write_pending() != Status::OK)
+        return Status::ERROR;
+
+    TAR_TIME(COMPRESS);
+    return m_encoder->end_frame();
+}
+
+Status OutStream::next_block()
+{
+    if (!m_record)
+        m_record = make_buffer(m_records_per_buffer * m_blocking_factor);
+
+    if (m_buffer_record >= m_records_per_buffer)
+    {
+        if (write_pending(true) != Status::OK)
+            return Status::ERROR;
+
+        m_buffer_record = 0;
+        m_written       = 0;
+    }
+
+    return Status::OK;
+}
+
+// Move past blocks that were put in the buffer
+void OutStream::advance(std::uint64_t blocks)
+{
+    std::uint64_t position = m_block_id + blocks;
+    TAR_COUNT(BLOCKS_WRITTEN, blocks);
+    TAR_COUNT(RECORDS_WRITTEN, position / m_blocking_factor);
+    m_buffer_record += position / m_blocking_factor;
+    m_record_id += position / m_blocking_factor;
+    m_block_id = position % m_blocking_factor;
+}
+
+Status OutStream::flush_record()
+{
+    if (!m_record)
+        return Status::ERROR;
+
+    if (m_block_id != 0)
+    {
+        auto padding = m_blocking_factor - m_block_id;
+        std::memset(current_block(), 0, BLOCK_SIZE * padding);
+        advance(padding);
+    }
+
+    if (write_pending(true) != Status::OK)
+        return Status::ERROR;
+
+    m_buffer_record = 0;
+    m_written       = 0;
+
+    return Status::OK;
+}
+
+ThreadPool::ThreadPool(std::uint32_t threads)
+    : m_stop(false)
+{
+    for (std::uint32_t i = 0; i < threads; ++i)
+        m_threads.emplace_back(&ThreadPool::work, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_condition.notify_all();
+
+    for (auto& thread : m_threads)
+        thread.join();
+}
+
+void ThreadPool::work()
+{
+    while (true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this]()
+                             { return m_stop || !m_tasks.empty(); });
+            if (m_tasks.empty())
+                return;
+
+            task = std::move(m_tasks.front());
+            m_tasks.pop();
+        }
+        task();
+    }
+}
+
+// Regular files up to this size are read by the workers in parallel mode,
+// bigger ones are only opened and streamed by the writer.
+constexpr std::size_t PREFETCH_LIMIT = 256 * 1024;
+
+static void set_checksum(Block& block)
+{
+    TAR_TIME(CHECKSUM);
+    Header& header = block.as_header;
+    std::sprintf(header.chksum, "%0*o", static_cast<int>(sizeof(header.chksum)) - 2, block.calculate_checksum());
+    header.chksum[sizeof(header.chksum) - 1] = 0x20;
+}
+
+// The data segments of a file with holes, rounded out to whole blocks so
+// that only the last one can end in a partial block. A file that ends in a
+// hole gets an empty last segment at its size, like GNU tar writes. Files
+// without holes, or on file systems that can not tell, get none.
+static void find_segments(int fd, std::uint64_t size, std::vector<Segment>& segments)
+{
+    TAR_TIME(STAT);
+    TAR_COUNT(SYSCALLS, 1);
+    off_t hole = lseek(fd, 0, SEEK_HOLE);
+    if (hole < 0 || static_cast<std::uint64_t>(hole) >= size)
+    {
+        lseek(fd, 0, SEEK_SET);
+        return;
+    }
+
+    std::uint64_t position = 0;
+    while (position < size)
+    {
+        TAR_COUNT(SYSCALLS, 2);
+        off_t data = lseek(fd, position, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+            break; // only a hole is left
+
+        hole = data < 0 ? -1 : lseek(fd, data, SEEK_HOLE);
+        if (hole < 0)
+        {
+            segments.clear();
+            lseek(fd, 0, SEEK_SET);
+            return;
+        }
+
+        std::uint64_t start = data / BLOCK_SIZE * BLOCK_SIZE;
+        std::uint64_t end   = std::min<std::uint64_t>(size, (hole + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE);
+        if (!segments.empty() && start <= segments.back().offset + segments.back().length)
+            segments.back().length = end - segments.back().offset;
+        else
+            segments.push_back({ start, end - start });
+        position = hole;
+    }
+
+    if (segments.empty() || segments.back().offset + segments.back().length < size)
+        segments.push_back({ size, 0 });
+}
+
+// 64 bit FNV-1a over whole words, only used to find files that may have
+// the same contents, which are then compared
+static std::uint64_t hash_data(View data, std::uint64_t hash = 0xcbf29ce484222325)
+{
+    std::size_t i = 0;
+    for (; i + sizeof(std::uint64_t) <= data.size(); i += sizeof(std::uint64_t))
+    {
+        std::uint64_t word;
+        std::memcpy(&word, data.data() + i, sizeof(word));
+        hash ^= word;
+        hash *= 0x100000001b3;
+    }
+    for (; i < data.size(); ++i)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001b3;
+    }
+
+    return hash;
+}
+
+// Reads with pread, so the offset the writer reads from does not move. The
+// same reads feed digest if it is set.
+static bool hash_file(int fd, std::uint64_t size, std::uint64_t& hash, Hasher* digest = nullptr)
+{
+    TAR_TIME(READ);
+    Data          buffer(std::min<std::uint64_t>(size, 1024 * 1024));
+    std::uint64_t done = 0;
+    hash               = hash_data({});
+    while (done < size)
+    {
+        TAR_COUNT(SYSCALLS, 1);
+        ssize_t bytes = pread(fd, buffer.data(), std::min<std::uint64_t>(buffer.size(), size - done), done);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return false;
+        hash = hash_data(View(buffer.data(), bytes), hash);
+        if (digest)
+            digest->update(View(buffer.data(), bytes));
+        done += bytes;
+    }
+
+    return true;
+}
+
+// Compare the file at path with the size bytes in data, or in fd if data is
+// empty
+static bool same_contents(const fs::path& path, int fd, View data, std::uint64_t size)
+{
+    TAR_TIME(READ);
+    TAR_COUNT(SYSCALLS, 1);
+    int original = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (original < 0)
+        return false;
+
+    Data          a(std::min<std::uint64_t>(size, 1024 * 1024));
+    Data          b(data.empty() ? a.size() : 0);
+    std::uint64_t done = 0;
+    bool          same = true;
+    while (same && done < size)
+    {
+        std::size_t chunk = std::min<std::uint64_t>(a.size(), size - done);
+        TAR_COUNT(SYSCALLS, data.empty() ? 2 : 1);
+        same = pread(original, a.data(), chunk, done) == static_cast<ssize_t>(chunk);
+        if (same && data.empty())
+            same = pread(fd, b.data(), chunk, done) == static_cast<ssize_t>(chunk)
+                && !std::memcmp(a.data(), b.data(), chunk);
+        else if (same)
+            same = !std::memcmp(a.data(), data.data() + done, chunk);
+        done += chunk;
+    }
+    close(original);
+
+    return same;
+}
+
+// A PAX record, whose length counts its own digits
+static std::string pax_record(const std::string& keyword, const std::string& value)
+{
+    std::size_t length = keyword.size() + value.size() + 3; // ' ', '=' and '\n'
+    std::size_t digits = std::to_string(length).size();
+    if (std::to_string(length + digits).size() != digits)
+        digits++;
+
+    return std::to_string(length + digits) + ' ' + keyword + '=' + value + '\n';
+}
+
+// Directories kept open for looking up their entries. Past this the
+// entries are looked up by their whole path, so wide trees do not run out
+// of file descriptors.
+constexpr std::uint32_t MAX_OPEN_DIRECTORIES = 256;
+
+static std::atomic<std::uint32_t> open_directories(0);
+
+// An open directory. Its entries are looked up relative to it, so the
+// kernel does not walk the whole path again for each of them.
+struct Archiver::Directory
+{
+    Directory(int fd)
+        : fd(fd)
+    {
+        open_directories++;
+    }
+
+    ~Directory()
+    {
+        close(fd);
+        open_directories--;
+    }
 
-    return st;
-}
+    int fd;
+};
 
-Status InStream::seek_record(std::uint32_t record_id)
+// A path to archive and where to look it up from
+struct Archiver::Node
 {
-    m_stream.seekg(record_id * BLOCK_SIZE * m_blocking_factor);
-    if (!m_stream)
-        return Status::ERROR;
-
-    m_record_id = record_id;
-    if (read_record() != Status::OK)
-        return Status::ERROR;
+    int at() const { return parent ? parent->fd : AT_FDCWD; }
 
-    m_block_id = 0;
+    const char* relative() const { return parent ? name.c_str() : path.c_str(); }
 
-    return Status::OK;
-}
+    fs::path                   path;
+    std::string                name;
+    std::shared_ptr<Directory> parent; // null for the source
+};
 
-Status InStream::skip_blocks(std::uint32_t count)
+// Everything the writer needs to emit one member
+struct Archiver::Entry
 {
-    if (m_block_id + count < m_blocking_factor)
-        m_block_id += count;
-    else
+    Entry() = default;
+
+    Entry(Entry&& other)
+        : path(std::move(other.path))
+        , status(other.status)
+        , is_directory(other.is_directory)
+        , unchanged(other.unchanged)
+        , hashed(other.hashed)
+        , size(other.size)
+        , state(other.state)
+        , device(other.device)
+        , inode(other.inode)
+        , links(other.links)
+        , skipped(other.skipped)
+        , content_hash(other.content_hash)
+        , digest(std::move(other.digest))
+        , header(other.header)
+        , blocks(std::move(other.blocks))
+        , segments(std::move(other.segments))
+        , children(std::move(other.children))
+        , data(std::move(other.data))
+        , fd(std::exchange(other.fd, -1))
     {
-        // go to the next record(a.k.a align the records)
-        count -= m_blocking_factor - m_block_id;
-        m_record_id += count / m_blocking_factor + 1;
-        if (seek_record(m_record_id) != Status::OK)
-            return Status::ERROR;
+    }
 
-        m_block_id = count % m_blocking_factor;
+    ~Entry()
+    {
+        if (fd >= 0)
+            close(fd);
     }
 
-    return Status::OK;
+    fs::path              path;
+    Status                status       = Status::OK;
+    bool                  is_directory = false;
+    bool                  unchanged    = false; // since the previous snapshot
+    bool                  hashed       = false;
+    std::size_t           size         = 0;
+    SnapshotEntry         state;
+    std::uint64_t         device       = 0;
+    std::uint64_t         inode        = 0;
+    std::uint32_t         links        = 0;
+    bool                  skipped      = false; // not selected, only its children are archived
+    std::uint64_t         content_hash = 0;     // with dedupe, of regular files
+    std::string           digest;               // in hex, of regular files
+    Block                 header;           // as create_header made it
+    std::vector<Block>    blocks;   // the header and any @LongName blocks
+    std::vector<Segment>  segments; // of sparse files, the rest are holes
+    std::vector<Node>     children;
+    Data                  data; // prefetched contents of small files
+    int                   fd = -1;
+};
+
+std::string NameCache::user(std::uint32_t uid)
+{
+    return find(m_users, uid, true);
 }
 
-Parser::Parser(InStream& tar_stream)
-    : m_stream(tar_stream)
+std::string NameCache::group(std::uint32_t gid)
 {
+    return find(m_groups, gid, false);
 }
 
-Status Parser::next_file(File& file)
+std::uint64_t NameCache::hits() const
 {
-    Block  block;
-    Status st = m_stream.read_block(block);
-    if (st != Status::OK)
-        return st;
+    return m_hits;
+}
 
-    st = check_block(block);
-    if (st != Status::OK)
-        return st;
+std::uint64_t NameCache::misses() const
+{
+    return m_misses;
+}
 
-    if (block.as_header.typeflag == 'L')
+std::string NameCache::find(Names& names, std::uint32_t id, bool is_user)
+{
     {
-        auto name_bytes = unpack(block.as_header);
-        file.name       = std::string(name_bytes.begin(),
-                                name_bytes.end());
-
-        st = m_stream.read_block(block);
-        if (st != Status::OK)
-            return st;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto                        it = names.find(id);
+        if (it != names.end())
+        {
+            m_hits++;
+            return it->second;
+        }
+    }
 
-        st = check_block(block);
-        if (st != Status::OK)
-            return st;
+    // The lookup is done without the lock, so a slow one does not hold up
+    // the other threads. Two threads may then look the same id up, which
+    // is harmless.
+    m_misses++;
+    std::string       name;
+    std::vector<char> buffer(1024);
+    if (is_user)
+    {
+        struct passwd  entry;
+        struct passwd* result = nullptr;
+        while (getpwuid_r(id, &entry, buffer.data(), buffer.size(), &result) == ERANGE)
+            buffer.resize(buffer.size() * 2);
+        if (result)
+            name = result->pw_name;
     }
     else
     {
-        if (block.as_header.name[sizeof(block.as_header.name) - 1])
-            file.name = std::string(block.as_header.name, 100);
-        else
-            file.name = std::string(block.as_header.name);
+        struct group  entry;
+        struct group* result = nullptr;
+        while (getgrgid_r(id, &entry, buffer.data(), buffer.size(), &result) == ERANGE)
+            buffer.resize(buffer.size() * 2);
+        if (result)
+            name = result->gr_name;
     }
 
-    file.header      = block.as_header;
-    file.m_block_id  = m_stream.block_id();
-    file.m_record_id = m_stream.record_id();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    names.emplace(id, name);
 
-    return Status::OK;
+    return name;
 }
 
-Data Parser::read_file(File& file)
+Archiver::Archiver(std::uint32_t threads,
+                   bool          numeric_owner,
+                   Format        format,
+                   bool          sparse,
+                   bool          dedupe,
+                   Matcher       matcher,
+                   Digest        records,
+                   Digest        manifest)
+    : m_threads(threads ? threads : std::max(1u, std::thread::hardware_concurrency()))
+    , m_numeric_owner(numeric_owner)
+    , m_format(format)
+    , m_sparse(sparse)
+    , m_dedupe(dedupe)
+    , m_matcher(std::move(matcher))
+    , m_records(records)
+    , m_manifest(manifest)
 {
-    m_stream.seek_record(file.m_record_id);
-    m_stream.skip_blocks(file.m_block_id);
+    if (records != Digest::NONE && manifest != Digest::NONE && records != manifest)
+        throw std::runtime_error("The records and the manifest need the same digest");
+}
 
-    return unpack(file.header);
+std::uint32_t Archiver::threads() const
+{
+    return m_threads;
 }
 
-Status Parser::list_files(std::list<File>& list)
+const NameCache& Archiver::names() const
 {
-    m_stream.seek_record(0);
-    list.clear();
-    Status st;
+    return m_names;
+}
 
-    do
-    {
-        File file;
-        st = next_file(file);
-        if (st != Status::OK)
-            break;
+const std::vector<std::pair<std::string, std::string>>& Archiver::digests() const
+{
+    return m_digests;
+}
 
-        std::uint32_t data_blocks = file.header.size_in_blocks();
-        st                        = m_stream.skip_blocks(data_blocks);
-        if (st != Status::OK)
-            break;
+Status Archiver::archive(const fs::path& src,
+                         const fs::path& dest,
+                         std::uint32_t   blocking_factor,
+                         Codec           codec)
+{
+    if (!fs::exists(src))
+    {
+        std::cerr << src << " does not exist!\n";
+        return Status::ERROR;
+    }
 
-        list.push_back(file);
-    } while (st == Status::OK);
+    OutStream out_stream(dest, blocking_factor, codec, m_threads);
 
-    if (st == Status::ERROR)
-        return st;
+    return archive(src, out_stream);
+}
 
-    return Status::OK;
+Status Archiver::archive(const fs::path& src, OutStream& out_stream)
+{
+    return walk(src, out_stream, nullptr, nullptr);
 }
 
-Status Parser::check_block(Block& block)
+Status Archiver::archive(const fs::path& src, OutStream& out_stream, const fs::path& snapshot)
 {
-    if (block.is_zero_block())
+    Snapshot previous;
+    if (fs::exists(snapshot))
     {
-        m_stream.read_block(block, false);
-        if (block.is_zero_block())
-            return Status::END;
-        else
+        std::ifstream  in(snapshot, std::ios::in | std::ios::binary);
+        SnapshotHeader header;
+
+        in.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if (!in || std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)))
+        {
+            std::cerr << snapshot << " is not a snapshot file\n";
+            return Status::ERROR;
+        }
+
+        previous.resize(header.count);
+        in.read(reinterpret_cast<char*>(previous.data()), previous.size() * sizeof(SnapshotEntry));
+        if (!in)
             return Status::ERROR;
     }
 
-    std::uint32_t sum        = block.calculate_checksum();
-    std::uint32_t header_sum = std::stoi(block.as_header.chksum, nullptr, 8);
-    if (sum != header_sum)
+    Snapshot current;
+    if (walk(src, out_stream, &previous, &current) != Status::OK)
+        return Status::ERROR;
+
+    std::sort(current.begin(), current.end(), [](const SnapshotEntry& a, const SnapshotEntry& b)
+              { return a.name_hash < b.name_hash; });
+
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.count = current.size();
+
+    // Written next to the old one and renamed over it, so a failed run keeps
+    // the previous snapshot
+    fs::path      temporary = snapshot.string() + ".tmp";
+    std::ofstream out(temporary, std::ios::out | std::ios::binary);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(current.data()), current.size() * sizeof(SnapshotEntry));
+    out.close();
+    if (!out || std::rename(temporary.c_str(), snapshot.c_str()) < 0)
     {
-        std::cerr << "Not matching checksums!\n";
+        std::cerr << "Could not write " << snapshot << '\n';
         return Status::ERROR;
     }
 
     return Status::OK;
 }
 
-Data Parser::unpack(const Header& header)
+Status Archiver::walk(const fs::path& src, OutStream& out_stream, const Snapshot* previous, Snapshot* current)
 {
-    std::uint32_t data_blocks = header.size_in_blocks();
-    std::uint32_t size        = header.size_in_bytes();
-    Data          bytes;
-    bytes.reserve(size);
+    if (!fs::exists(src))
+    {
+        std::cerr << src << " does not exist!\n";
+        return Status::ERROR;
+    }
 
-    for (std::uint32_t i = 0; i < data_blocks; ++i)
+    std::queue<Node> to_be_visited;
+    to_be_visited.push({ src, {}, nullptr });
+
+    // Entries are handed out in the order of the queue and written in the
+    // order they were handed out, so the output does not depend on m_threads.
+    // With one thread the deferred tasks run on the writer when it asks for
+    // them, which is the plain serial walk.
+    bool                           parallel = m_threads > 1;
+    std::unique_ptr<ThreadPool>    pool(parallel ? new ThreadPool(m_threads) : nullptr);
+    std::size_t                    window = parallel ? 16 * m_threads : 1;
+    std::deque<std::future<Entry>> in_flight;
+
+    // Entries already in the archive with their data, by inode and, with
+    // dedupe, by contents
+    Inodes    inodes;
+    Originals originals;
+    m_digests.clear();
+
+    while (!to_be_visited.empty() || !in_flight.empty())
     {
-        Block block;
-        if (m_stream.read_block(block) != Status::OK)
-            return {};
+        while (in_flight.size() < window && !to_be_visited.empty())
+        {
+            auto task = [this, node = std::move(to_be_visited.front()), parallel, previous]()
+            {
+                Entry entry;
+                prepare(node, entry, parallel, previous);
+                return entry;
+            };
+
+            if (parallel)
+                in_flight.push_back(pool->submit(std::move(task)));
+            else
+                in_flight.push_back(std::async(std::launch::deferred, std::move(task)));
+            to_be_visited.pop();
+        }
+
+        Entry entry = in_flight.front().get();
+        in_flight.pop_front();
+
+        if (entry.status != Status::OK)
+            return Status::ERROR;
+
+        if (entry.skipped)
+        {
+            for (auto& child : entry.children)
+                to_be_visited.push(std::move(child));
+            continue;
+        }
+
+        if (current)
+            current->push_back(entry.state);
+        if (entry.unchanged)
+            continue;
+
+        if (!entry.is_directory)
+            link_duplicate(entry, inodes, originals);
+
+        if (out_stream.member_boundary() != Status::OK || out_stream.write_blocks(entry.blocks) != Status::OK)
+            return Status::ERROR;
+        TAR_MEMBER(entry.size);
+
+        // Files whose digest was not known before their header are hashed
+        // while they are copied. Hard links carry no data and get none.
+        std::unique_ptr<Hasher> hasher;
+        if (m_manifest != Digest::NONE && entry.digest.empty() && entry.size && entry.segments.empty())
+            hasher = make_hasher(m_manifest);
 
-        if (size)
+        Status st = Status::OK;
+        if (entry.is_directory)
+        {
+            for (auto& child : entry.children)
+                to_be_visited.push(std::move(child));
+        }
+        else if (!entry.segments.empty())
         {
-            std::uint32_t bytes_to_copy = BLOCK_SIZE;
-            if (size < BLOCK_SIZE)
-                bytes_to_copy = size;
+            for (const auto& segment : entry.segments)
+            {
+                if (st != Status::OK || !segment.length)
+                    continue;
+                if (lseek(entry.fd, segment.offset, SEEK_SET) < 0)
+                    st = Status::ERROR;
+                else
+                    st = out_stream.write_data(entry.fd, segment.length);
+            }
+        }
+        else if (entry.size == entry.data.size())
+            st = out_stream.write_data(entry.data);
+        else if (entry.fd >= 0)
+            st = out_stream.write_data(entry.fd, entry.size, hasher.get());
+        else
+            st = pack(entry.path, entry.size, out_stream, hasher.get());
 
-            bytes.insert(bytes.end(), block.as_data, block.as_data + bytes_to_copy);
-            size -= bytes_to_copy;
+        if (st != Status::OK)
+        {
+            std::cerr << "Cound not read " << entry.path << '\n';
+            return Status::ERROR;
         }
+
+        if (hasher)
+            entry.digest = hasher->finish();
+        if (m_manifest != Digest::NONE && !entry.digest.empty())
+            m_digests.emplace_back(entry.path.string(), entry.digest);
     }
 
-    return bytes;
+    // Write two zero blocks to indicate the end of the archive
+    Block zeros;
+    std::memset(&zeros, 0, sizeof(Block));
+    if (out_stream.write_block(zeros) != Status::OK || out_stream.write_block(zeros) != Status::OK
+        || out_stream.close() != Status::OK)
+    {
+        std::cerr << "Could not write " << out_stream.file_path() << '\n';
+        return Status::ERROR;
+    }
+
+    return Status::OK;
 }
 
-OutStream::OutStream(const std::string& file_path, std::uint32_t blocking_factor)
-    : BlockStream(file_path, blocking_factor)
+void Archiver::prepare(const Node& node, Entry& entry, bool prefetch, const Snapshot* previous)
 {
-    m_stream.open(m_file_path, std::ios::out | std::ios::binary);
-    if (!m_stream)
+    Block       header_block;
+    std::string link;
+    entry.path   = node.path;
+    entry.status = create_header(node, header_block, entry, link);
+    if (entry.status != Status::OK)
+        return;
+    entry.header = header_block;
+
+    // Directories on the way to selected paths are read but not archived
+    if (!m_matcher.selects(node.path.native()))
     {
-        std::string error_msg("Could not open file ");
-        error_msg.append(file_path);
-        throw std::runtime_error(error_msg);
+        entry.skipped = true;
+        if (header_block.as_header.typeflag == '5')
+            entry.status = list_directory(node, entry.children);
+        return;
     }
-}
 
-OutStream::~OutStream()
-{
-    if (m_block_id != 0)
-        flush_record();
-}
+    // Directories are kept so that extracting the increment recreates them
+    if (previous && header_block.as_header.typeflag != '5')
+    {
+        auto found = std::lower_bound(previous->begin(), previous->end(), entry.state,
+                                      [](const SnapshotEntry& a, const SnapshotEntry& b)
+                                      { return a.name_hash < b.name_hash; });
+        entry.unchanged = found != previous->end() && found->name_hash == entry.state.name_hash
+            && found->mtime == entry.state.mtime && found->size == entry.state.size;
+        if (entry.unchanged)
+            return;
+    }
 
-Status OutStream::write_block(const Block& block)
-{
-    if (!m_record)
-        m_record = std::make_unique<Block[]>(m_blocking_factor);
+    Header& header     = header_block.as_header;
+    entry.is_directory = header.typeflag == '5';
+    entry.size         = header.size_in_bytes();
 
-    if (m_block_id >= m_blocking_factor)
+    // Failures are left to the writer, which retries through pack
+    if (entry.size)
     {
-        if (flush_record() != Status::OK)
-            return Status::ERROR;
+        TAR_COUNT(SYSCALLS, 1);
+        entry.fd = openat(node.at(), node.relative(), O_RDONLY | O_CLOEXEC);
+        if (entry.fd >= 0 && m_sparse)
+            find_segments(entry.fd, entry.size, entry.segments);
+    }
 
-        m_record_id++;
+    // A sparse member has a made up name in its header, the real one, the
+    // size and the map go in the extended header and at the start of the data
+    bool        sparse = !entry.segments.empty();
+    std::string name   = node.path.string();
+    std::string records;
+    std::string map;
+    if (sparse)
+    {
+        map        = std::to_string(entry.segments.size()) + '\n';
+        entry.size = 0;
+        for (const auto& segment : entry.segments)
+        {
+            map += std::to_string(segment.offset) + '\n' + std::to_string(segment.length) + '\n';
+            entry.size += segment.length;
+        }
+        map.resize((map.size() + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE, '\0');
+
+        records += pax_record("GNU.sparse.major", "1");
+        records += pax_record("GNU.sparse.minor", "0");
+        records += pax_record("GNU.sparse.name", name);
+        records += pax_record("GNU.sparse.realsize", std::to_string(entry.state.size));
+
+        std::string sparse_name = (node.path.parent_path() / "GNUSparseFile.0" / node.path.filename()).string();
+        std::memset(header.name, 0, sizeof(header.name));
+        std::memcpy(header.name, sparse_name.data(), std::min(sparse_name.size(), sizeof(header.name)));
+        format_number(header.size, map.size() + entry.size);
+        set_checksum(header_block);
     }
 
-    m_record[m_block_id] = block;
-    m_block_id++;
+    // Small files are read ahead by the workers, and with records also in
+    // serial mode, so that their digest can go in the extended header.
+    // Sparse files are read segment by segment by the writer and, even when
+    // they are all holes, have no digest.
+    Digest digest = m_records != Digest::NONE ? m_records : m_manifest;
+    if (entry.fd >= 0 && !sparse)
+    {
+        if ((prefetch || m_records != Digest::NONE) && entry.size <= PREFETCH_LIMIT)
+            read_contents(entry);
+        else
+        {
+            posix_fadvise(entry.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            if (prefetch)
+                posix_fadvise(entry.fd, 0, PREFETCH_LIMIT, POSIX_FADV_WILLNEED);
+        }
+
+        // With dedupe, bigger files are read once more for the hash and the
+        // digest comes along, the writer gets them from the page cache.
+        // Otherwise the writer hashes them, too late for a record.
+        auto hasher = make_hasher(digest);
+        bool hashed = true;
+        if (!entry.data.empty())
+        {
+            if (m_dedupe)
+                entry.content_hash = hash_data(entry.data);
+            if (hasher)
+                hasher->update(entry.data);
+        }
+        else if (m_dedupe)
+            hashed = hash_file(entry.fd, entry.size, entry.content_hash, hasher.get());
+        else
+            hasher.reset();
+
+        entry.hashed = m_dedupe && hashed;
+        if (hasher && hashed)
+            entry.digest = hasher->finish();
+    }
+    else if (digest != Digest::NONE && header.typeflag == '0' && !entry.size && !sparse)
+        entry.digest = make_hasher(digest)->finish();
 
-    return Status::OK;
+    if (m_records != Digest::NONE && !entry.digest.empty())
+        records += pax_record(digest_keyword(m_records), entry.digest);
+
+    create_blocks(entry, header_block, link, std::move(records));
+
+    for (std::size_t offset = 0; offset < map.size(); offset += BLOCK_SIZE)
+    {
+        Block block;
+        std::memcpy(block.as_data, map.data() + offset, BLOCK_SIZE);
+        entry.blocks.push_back(block);
+    }
+
+    if (entry.is_directory)
+        entry.status = list_directory(node, entry.children);
 }
 
-Status OutStream::write_blocks(const std::vector<Block>& blocks)
+void Archiver::read_contents(Entry& entry)
 {
-    for (const auto& block : blocks)
-        if (write_block(block) != Status::OK)
-            return Status::ERROR;
+    TAR_TIME(READ);
+    entry.data.resize(entry.size);
+    std::size_t done = 0;
+    while (done < entry.size)
+    {
+        TAR_COUNT(SYSCALLS, 1);
+        ssize_t bytes = read(entry.fd, entry.data.data() + done, entry.size - done);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            break;
+        done += bytes;
+    }
 
-    return Status::OK;
+    if (done != entry.size)
+        entry.data.clear();
+    else
+    {
+        close(entry.fd);
+        entry.fd = -1;
+    }
 }
 
-Status OutStream::flush_record()
+// Later links to an inode become hard links to the first one. With dedupe,
+// so do files with the same contents, mode and owner as an earlier one.
+// Hash matches are compared byte by byte before they are trusted.
+void Archiver::link_duplicate(Entry& entry, Inodes& inodes, Originals& originals)
 {
-    if (!m_record)
-        return Status::ERROR;
+    if (entry.links > 1)
+    {
+        auto [found, inserted] = inodes.try_emplace({ entry.device, entry.inode }, entry.path.string());
+        if (!inserted)
+        {
+            link_entry(entry, found->second);
+            return;
+        }
+    }
 
-    if (m_block_id < m_blocking_factor)
+    if (!entry.hashed)
+        return;
+
+    const Header& header = entry.header.as_header;
+    auto [first, last]   = originals.equal_range(entry.content_hash);
+    for (auto it = first; it != last; ++it)
     {
-        auto padding = m_blocking_factor - m_block_id;
-        std::memset(m_record.get() + m_block_id, 0, BLOCK_SIZE * padding);
+        const Header& original = it->second.header.as_header;
+        if (it->second.size == entry.size && !std::memcmp(original.mode, header.mode, sizeof(header.mode))
+            && !std::memcmp(original.uid, header.uid, sizeof(header.uid))
+            && !std::memcmp(original.gid, header.gid, sizeof(header.gid))
+            && same_contents(it->second.path, entry.fd, entry.data, entry.size))
+        {
+            link_entry(entry, it->second.path.string());
+            return;
+        }
     }
 
-    m_stream.write(reinterpret_cast<char*>(m_record.get()),
-                   BLOCK_SIZE * m_blocking_factor);
+    originals.emplace(entry.content_hash, Original { entry.path, entry.size, entry.header });
+}
 
-    if (!m_stream)
-        return Status::ERROR;
+// Turn an entry into a hard link to target, which is already in the archive
+void Archiver::link_entry(Entry& entry, const std::string& target)
+{
+    Block   header_block = entry.header;
+    Header& header       = header_block.as_header;
+    header.typeflag      = '1';
+    format_number(header.size, 0);
+    std::memset(header.linkname, 0, sizeof(header.linkname));
+    std::memcpy(header.linkname, target.data(), std::min(target.size(), sizeof(header.linkname)));
+    set_checksum(header_block);
+
+    if (entry.fd >= 0)
+        close(entry.fd);
+    entry.fd   = -1;
+    entry.size = 0;
+    entry.data.clear();
+    entry.digest.clear();
+    entry.segments.clear();
+    entry.blocks.clear();
+    create_blocks(entry, header_block, target, {});
+}
 
-    m_block_id = 0;
+void Archiver::create_blocks(Entry& entry, const Block& header_block, const std::string& link, std::string records)
+{
+    const Header& header = header_block.as_header;
+    std::string   name   = entry.path.string();
+    bool          sparse = !entry.segments.empty();
 
-    return Status::OK;
+    // Handle the case of too long names
+    if (m_format == Format::PAX)
+    {
+        if (!sparse && name.size() > sizeof(header.name))
+            records += pax_record("path", name);
+        if (link.size() > sizeof(header.linkname))
+            records += pax_record("linkpath", link);
+        if (header.size_in_bytes() >> 33)
+            records += pax_record("size", std::to_string(header.size_in_bytes()));
+        if (entry.state.mtime > 0 && entry.state.mtime % 1000000000)
+        {
+            char mtime[32];
+            std::snprintf(mtime, sizeof(mtime), "%lld.%09lld", static_cast<long long>(entry.state.mtime / 1000000000),
+                          static_cast<long long>(entry.state.mtime % 1000000000));
+            records += pax_record("mtime", mtime);
+        }
+    }
+    else
+    {
+        if (!sparse && name.size() > sizeof(header.name))
+            create_extended_blocks("././@LongName", 'L', name, entry.blocks, header);
+        if (link.size() > sizeof(header.linkname))
+            create_extended_blocks("././@LongLink", 'K', link, entry.blocks, header);
+    }
+
+    if (!records.empty())
+    {
+        std::string pax_name = (entry.path.parent_path() / "PaxHeaders" / entry.path.filename()).string();
+        create_extended_blocks(pax_name.c_str(), 'x', records, entry.blocks, header);
+    }
+    entry.blocks.push_back(header_block);
 }
 
-Status Archiver::archive(const fs::path& src, const fs::path& dest, std::uint32_t blocking_factor)
+// The names come straight from getdents64 in directory order, without a
+// stat per entry
+Status Archiver::list_directory(const Node& node, std::vector<Node>& children)
 {
-    if (!fs::exists(src))
+    TAR_TIME(STAT);
+    TAR_COUNT(SYSCALLS, 1);
+    int fd = openat(node.at(), node.relative(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
     {
-        std::cerr << src << " does not exist!\n";
+        std::cerr << "Could not open directory " << node.path << '\n';
         return Status::ERROR;
     }
 
-    OutStream            out_stream(dest, blocking_factor);
-    std::queue<fs::path> to_be_visited;
-    to_be_visited.push(src);
+    std::shared_ptr<Directory> directory;
+    if (open_directories < MAX_OPEN_DIRECTORIES)
+        directory = std::make_shared<Directory>(fd);
 
-    while (!to_be_visited.empty())
+    alignas(dirent64) char buffer[32 * 1024];
+    ssize_t                bytes;
+    while (true)
     {
-        const auto& thing = to_be_visited.front();
-        Block       header_block;
-        create_header(thing, header_block);
-        std::vector<Block> blocks;
-        // Handle the case of too long names
-        if (thing.string().size() > 100)
-            create_long_name_blocks(thing.string(), blocks, header_block.as_header);
+        TAR_COUNT(SYSCALLS, 1);
+        bytes = getdents64(fd, buffer, sizeof(buffer));
+        if (bytes <= 0)
+            break;
 
-        if (fs::is_directory(thing))
+        for (ssize_t offset = 0; offset < bytes;)
         {
-            for (auto const& entry : std::filesystem::directory_iterator { thing })
-                to_be_visited.push(entry.path());
-            blocks.push_back(header_block);
+            auto entry = reinterpret_cast<const dirent64*>(buffer + offset);
+            offset += entry->d_reclen;
+            if (!std::strcmp(entry->d_name, ".") || !std::strcmp(entry->d_name, ".."))
+                continue;
+
+            // Subtrees are pruned here, before anything below them is looked at
+            fs::path path = node.path / entry->d_name;
+            if (!m_matcher.empty() && !m_matcher.selects(path.native())
+                && ((entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) || !m_matcher.may_contain(path.native())))
+                continue;
+
+            children.push_back({ std::move(path), entry->d_name, directory });
         }
-        else
-        {
-            blocks.push_back(header_block);
-            if (pack(thing, blocks) != Status::OK)
-            {
-                std::cerr << "Cound not read " << thing << '\n';
-                return Status::ERROR;
-            }
-        }
-
-        out_stream.write_blocks(blocks);
-        to_be_visited.pop();
     }
 
-    // Write two zero blocks to indicate the end of the archive
-    Block zeros;
-    std::memset(&zeros, 0, sizeof(Block));
-    out_stream.write_block(zeros);
-    out_stream.write_block(zeros);
+    if (!directory)
+        close(fd);
+
+    if (bytes < 0)
+    {
+        std::cerr << "Could not list " << node.path << '\n';
+        return Status::ERROR;
+    }
 
     return Status::OK;
 }
 
-Status Archiver::create_header(const fs::path& path, Block& header_block)
+Status Archiver::create_header(const Node& node, Block& header_block, Entry& entry, std::string& link)
 {
-    struct stat info;
-    Header&     header = header_block.as_header;
+    const fs::path& path = node.path;
+    struct statx    info;
+    Header&         header = header_block.as_header;
 
-    if (lstat(path.string().c_str(), &info) < 0)
+    // Only what goes in the header is asked for, which some file systems
+    // can answer faster
     {
-        std::cerr << "stat for " << path << " failed\n";
-        return Status::ERROR;
+        TAR_TIME(STAT);
+        TAR_COUNT(SYSCALLS, 1);
+        unsigned int mask = STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_MTIME | STATX_SIZE | STATX_NLINK | STATX_INO;
+        if (statx(node.at(), node.relative(), AT_SYMLINK_NOFOLLOW, mask, &info) < 0)
+        {
+            std::cerr << "stat for " << path << " failed\n";
+            return Status::ERROR;
+        }
     }
 
     std::memset(&header, 0, sizeof(Block));
-    std::string name = path.string();
+    std::string    name  = path.string();
+    SnapshotEntry& state = entry.state;
+    state.name_hash      = Parser::hash_name(name);
+    state.mtime          = info.stx_mtime.tv_sec * 1000000000 + info.stx_mtime.tv_nsec;
+    state.size           = info.stx_size;
+    entry.device         = makedev(info.stx_dev_major, info.stx_dev_minor);
+    entry.inode          = info.stx_ino;
+    entry.links          = info.stx_nlink;
     if (name.size() >= 100)
         std::memcpy(header.name, path.string().c_str(), sizeof(header.name));
     else
         std::strncpy(header.name, path.string().c_str(), sizeof(header.name) - 1);
 
-    std::sprintf(header.mode, "%0*o", static_cast<int>(sizeof(header.mode)) - 1, static_cast<std::uint16_t>(info.st_mode & ~S_IFMT));
-    std::sprintf(header.uid, "%0*o", static_cast<int>(sizeof(header.uid)) - 1, info.st_uid);
-    std::sprintf(header.gid, "%0*o", static_cast<int>(sizeof(header.gid)) - 1, info.st_gid);
-    if (!fs::is_directory(path))
-        std::sprintf(header.size, "%0*lo", static_cast<int>(sizeof(header.size)) - 1, info.st_size);
+    format_number(header.mode, info.stx_mode & ~S_IFMT);
+    format_number(header.uid, info.stx_uid);
+    format_number(header.gid, info.stx_gid);
+    // Only regular files have data, the rest is described by the header.
+    // Sizes from 8 GiB on are base-256.
+    if (S_ISREG(info.stx_mode))
+        format_number(header.size, info.stx_size);
     else
         std::memset(header.size, '0', sizeof(header.size) - 1);
 
-    switch (info.st_mode & S_IFMT)
+    switch (info.stx_mode & S_IFMT)
     {
     case S_IFREG:
         header.typeflag = '0';
         break;
     case S_IFLNK:
-        header.typeflag = '1';
+    {
+        TAR_TIME(STAT);
+        TAR_COUNT(SYSCALLS, 1);
+        header.typeflag = '2';
+        char    target[PATH_MAX];
+        ssize_t length = readlinkat(node.at(), node.relative(), target, sizeof(target));
+        if (length < 0)
+        {
+            std::cerr << "readlink for " << path << " failed\n";
+            return Status::ERROR;
+        }
+
+        // Longer targets go in an extended header
+        link.assign(target, length);
+        std::memcpy(header.linkname, target, std::min(link.size(), sizeof(header.linkname)));
         break;
+    }
     case S_IFCHR:
         header.typeflag = '3';
         break;
@@ -477,104 +3509,82 @@ Status Archiver::create_header(const fs::path& path, Block& header_block)
         break; // what is the correct value?
     }
 
-    std::sprintf(header.mtime, "%lo", info.st_mtime);
+    std::sprintf(header.mtime, "%lo", static_cast<unsigned long>(info.stx_mtime.tv_sec));
     std::sprintf(header.magic, "ustar");
 
-    header.version[0] = 0x20;
-    header.version[1] = 0x20;
-
-    struct passwd* pw = getpwuid(info.st_uid);
-    if (pw)
-        std::strncpy(header.uname, pw->pw_name, sizeof(header.uname) - 1);
+    header.version[0] = m_format == Format::PAX ? '0' : 0x20;
+    header.version[1] = m_format == Format::PAX ? '0' : 0x20;
 
-    struct group* gr = getgrgid(info.st_gid);
-    if (gr)
-        std::strncpy(header.gname, gr->gr_name, sizeof(header.gname) - 1);
+    if (!m_numeric_owner)
+    {
+        TAR_TIME(LOOKUP);
+        std::strncpy(header.uname, m_names.user(info.stx_uid).c_str(), sizeof(header.uname) - 1);
+        std::strncpy(header.gname, m_names.group(info.stx_gid).c_str(), sizeof(header.gname) - 1);
+    }
 
-    std::memset(header.devmajor, '0', sizeof(header.devmajor) - 1);
-    std::memset(header.devminor, '0', sizeof(header.devminor) - 1);
-    std::sprintf(header.chksum, "%0*o", static_cast<int>(sizeof(header.chksum)) - 2, header_block.calculate_checksum());
-    header.chksum[sizeof(header.chksum) - 1] = 0x20;
+    if (S_ISCHR(info.stx_mode) || S_ISBLK(info.stx_mode))
+    {
+        format_number(header.devmajor, info.stx_rdev_major);
+        format_number(header.devminor, info.stx_rdev_minor);
+    }
+    else
+    {
+        std::memset(header.devmajor, '0', sizeof(header.devmajor) - 1);
+        std::memset(header.devminor, '0', sizeof(header.devminor) - 1);
+    }
+    set_checksum(header_block);
 
     return Status::OK;
 }
 
-void Archiver::create_long_name_blocks(const std::string&  name,
-                                       std::vector<Block>& blocks,
-                                       const Header&       real_header)
+void Archiver::create_extended_blocks(const char*         name,
+                                      char                typeflag,
+                                      const std::string&  data,
+                                      std::vector<Block>& blocks,
+                                      const Header&       real_header)
 {
     Block fake_block;
     std::memset(&fake_block, 0, sizeof(Block));
     Header& fake_header = fake_block.as_header;
 
-    std::strncpy(fake_header.name, "././@LongName", sizeof(fake_header.name) - 1);
+    std::strncpy(fake_header.name, name, sizeof(fake_header.name) - 1);
     std::strncpy(fake_header.mode, real_header.mode, sizeof(fake_header.mode));
     std::memset(fake_header.uid, '0', sizeof(fake_header.uid) - 1);
     std::memset(fake_header.gid, '0', sizeof(fake_header.gid) - 1);
-    std::sprintf(fake_header.size, "%0*lo", static_cast<int>(sizeof(fake_header.size)) - 1, name.size());
+    format_number(fake_header.size, data.size());
     std::memset(fake_header.mtime, '0', sizeof(fake_header.mtime) - 1);
-    fake_header.typeflag = 'L';
-    std::sprintf(fake_header.magic, "ustar");
-    fake_header.version[0] = 0x20;
-    fake_header.version[1] = 0x20;
+    fake_header.typeflag = typeflag;
+    std::memcpy(fake_header.magic, real_header.magic, sizeof(fake_header.magic));
+    std::memcpy(fake_header.version, real_header.version, sizeof(fake_header.version));
     std::strncpy(fake_header.uname, "root", sizeof(fake_header.uname) - 1);
     std::strncpy(fake_header.gname, "root", sizeof(fake_header.gname) - 1);
-    std::sprintf(fake_header.chksum, "%0*o", static_cast<int>(sizeof(fake_header.chksum)) - 2, fake_block.calculate_checksum());
-    fake_header.chksum[sizeof(fake_header.chksum) - 1] = 0x20;
+    set_checksum(fake_block);
 
     blocks.push_back(fake_block);
 
-    std::size_t size    = name.size();
-    std::size_t nBlocks = size / BLOCK_SIZE;
-    if (size % BLOCK_SIZE)
-        nBlocks++;
-
-    const char* pName = name.c_str();
-    for (std::size_t i = 0; i < nBlocks; ++i)
+    for (std::size_t offset = 0; offset < data.size(); offset += BLOCK_SIZE)
     {
         Block block;
-        if (i != nBlocks - 1)
-            std::memcpy(&block, pName + i * BLOCK_SIZE, BLOCK_SIZE);
-        else
-        {
-            std::size_t last_block_size = BLOCK_SIZE;
-            if (size % BLOCK_SIZE)
-                last_block_size = size % BLOCK_SIZE;
-            std::memset(&block, 0, sizeof(Block));
-            std::memcpy(&block, pName + i * BLOCK_SIZE, last_block_size);
-        }
+        std::memset(&block, 0, sizeof(Block));
+        std::memcpy(&block, data.data() + offset, std::min<std::size_t>(BLOCK_SIZE, data.size() - offset));
         blocks.push_back(block);
     }
 }
 
-Status Archiver::pack(const fs::path& path, std::vector<Block>& blocks)
+Status Archiver::pack(const fs::path& path, std::size_t size, OutStream& out_stream, Hasher* digest)
 {
-    std::fstream in(path, std::ios::in | std::ios::binary);
-    std::size_t  total_bytes  = fs::file_size(path);
-    std::size_t  total_blocks = total_bytes / BLOCK_SIZE;
-
-    if (total_bytes % BLOCK_SIZE)
-        total_blocks++;
-    blocks.reserve(blocks.capacity() + total_blocks);
+    if (!size)
+        return Status::OK;
 
-    std::array<Block, 10> cache;
-    std::size_t           blocks_read = 0;
-    while (total_blocks > 0)
-    {
-        std::memset(cache.data(), 0, cache.size() * sizeof(Block));
-        in.read(reinterpret_cast<char*>(cache.data()), cache.size() * sizeof(Block));
-        if (total_blocks > cache.size())
-            blocks_read = cache.size();
-        else
-            blocks_read = total_blocks;
-        total_blocks -= blocks_read;
-
-        if (total_blocks > 0 && !in)
-            return Status::ERROR;
+    TAR_COUNT(SYSCALLS, 1);
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return Status::ERROR;
 
-        blocks.insert(blocks.end(), cache.begin(), cache.begin() + blocks_read);
-    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    Status st = out_stream.write_data(fd, size, digest);
+    close(fd);
 
-    return Status::OK;
+    return st;
 }
 }
@@ -1,12 +1,23 @@
 #ifndef TARSTREAM_HH
 #define TARSTREAM_HH
 
+#include "match.hh"
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <queue>
+#include <span>
+#include <string_view>
+#include <thread>
 #include <type_traits>
 #include <unordered_map>
 #include <vector>
@@ -19,9 +30,60 @@ enum class Status
     END,
     ERROR
 };
+
+enum class Backend
+{
+    STREAM, // records are read(2) into a record buffer
+    MMAP,   // the whole archive is mapped and blocks are viewed in place
+    URING   // several records are read ahead or written behind with io_uring
+};
+
+// Compression of the archive file. InStream detects it by the magic bytes.
+enum class Codec
+{
+    NONE,
+    GZIP,
+    ZSTD
+};
+
+// Digest of the data of regular files, see digest.hh
+enum class Digest
+{
+    NONE,
+    SHA256,
+    XXH64
+};
+
+// Expected digests by member name
+typedef std::unordered_map<std::string, std::string> Manifest;
+
+// How the Archiver stores what does not fit in a ustar header
+enum class Format
+{
+    GNU, // @LongLink members for long names, base-256 numbers
+    PAX  // extended headers, which also keep the mtime to the nanosecond
+};
+
+class Decoder;
+class Encoder;
+class Hasher;
+class Uring;
 namespace fs = std::filesystem;
-typedef std::vector<std::uint8_t> Data;
-constexpr std::uint32_t           BLOCK_SIZE = 512;
+typedef std::vector<std::uint8_t>     Data;
+typedef std::span<const std::uint8_t> View;
+constexpr std::uint32_t               BLOCK_SIZE = 512;
+
+// How much of the archive is read or written per system call. It is
+// rounded down to whole records, but never below one.
+constexpr std::size_t DEFAULT_BUFFER_SIZE = 1024 * 1024;
+
+// Bigger buffers are cut down to this. io_uring moves a whole buffer per
+// request and only takes 32-bit lengths.
+constexpr std::size_t MAX_BUFFER_SIZE = 1024 * 1024 * 1024;
+
+// Frames of seekable archives end at the first member after this many
+// uncompressed bytes, so finding a member decodes about this much
+constexpr std::size_t FRAME_SIZE = 4 * 1024 * 1024;
 
 // The header block(POSIX 1003.1-1990)
 struct Header
@@ -43,13 +105,31 @@ struct Header
     char devminor[8];
     char prefix[155];
 
-    std::uint32_t size_in_blocks() const;
+    std::uint64_t size_in_blocks() const;
 
-    std::uint32_t size_in_bytes() const;
+    std::uint64_t size_in_bytes() const;
 
     friend std::ostream& operator<<(std::ostream& os, const Header& header);
 };
 
+// Numeric header fields are octal, or GNU base-256 when the value does not
+// fit. Malformed fields read as 0.
+std::uint64_t parse_number(const char* field, std::size_t length);
+
+void format_number(char* field, std::size_t length, std::uint64_t value);
+
+template <std::size_t N>
+std::uint64_t parse_number(const char (&field)[N])
+{
+    return parse_number(field, N);
+}
+
+template <std::size_t N>
+void format_number(char (&field)[N], std::uint64_t value)
+{
+    format_number(field, N, value);
+}
+
 struct Block
 {
     union
@@ -65,48 +145,189 @@ struct Block
     friend std::ostream& operator<<(std::ostream& os, const Block& block);
 };
 
+// An implementation of the per block hot loops. Block uses the first entry
+// of block_kernels(), the rest are kept around for benchmarking.
+struct BlockKernel
+{
+    const char* name;
+    std::uint32_t (*checksum)(const Block& block);
+    bool (*is_zero)(const Block& block);
+};
+
+// The kernels this CPU can run, the fastest first
+const std::vector<BlockKernel>& block_kernels();
+
+// Where a frame of a seekable compressed archive starts, in the file and in
+// the decoded stream
+struct Frame
+{
+    std::uint64_t compressed;
+    std::uint64_t uncompressed;
+};
+
+// Where data is in a sparse file, everything else is a hole
+struct Segment
+{
+    std::uint64_t offset;
+    std::uint64_t length;
+};
+
+// A member as described by its header and any GNU long name or PAX extended
+// header before it. A PAX size or mtime is written back into header, so
+// header.size_in_bytes() is always the size of the member data.
 struct File
 {
-    Header      header;
-    std::string name;
+    Header               header;
+    std::string          name;
+    std::string          link_name;
+    std::uint32_t        mtime_nsec = 0; // only PAX archives have it
+    std::vector<Segment> sparse_map;     // PAX 1.0 sparse members store these segments back to back
+    std::uint64_t        real_size = 0;  // of sparse members once extracted
+    Digest               digest_type = Digest::NONE;
+    std::string          digest; // in hex, from a TARTOOLS.<digest> record
 
 private:
     std::uint32_t m_block_id;
-    std::uint32_t m_record_id;
+    std::uint64_t m_record_id;
 
     friend class Parser;
 };
 
+// A member in a Listing, with the numbers of its header already decoded
+struct Member
+{
+    std::uint64_t record_id; // where the data starts
+    std::uint64_t size;
+    std::uint64_t mtime;
+    std::uint64_t name; // where the name starts in Listing::names, the link name follows it
+    std::uint32_t name_length;
+    std::uint32_t link_length;
+    std::uint32_t block_id;
+    std::uint32_t mode;
+    std::uint32_t uid;
+    std::uint32_t gid;
+    char          typeflag;
+};
+
+// The members of an archive in two flat arrays, with no allocation per member
+struct Listing
+{
+    std::vector<Member> members;
+    std::string         names; // of every member, back to back
+
+    std::string_view name(const Member& member) const { return std::string_view(names).substr(member.name, member.name_length); }
+
+    std::string_view link_name(const Member& member) const
+    {
+        return std::string_view(names).substr(member.name + member.name_length, member.link_length);
+    }
+};
+
+// One entry of the sidecar index written by Parser::write_index. Entries are
+// sorted by name_hash so the file can be binary searched in place.
+struct IndexEntry
+{
+    std::uint64_t name_hash;
+    std::uint64_t record_id; // position of the first header block of the member
+    std::uint32_t block_id;
+    char          typeflag;
+    char          padding[3];
+    std::uint64_t size;
+    std::uint64_t mtime;
+};
+
+// One entry of an incremental snapshot written by Archiver::archive. Entries
+// are sorted by name_hash like the index.
+struct SnapshotEntry
+{
+    std::uint64_t name_hash;
+    std::int64_t  mtime; // in nanoseconds
+    std::uint64_t size;
+};
+
+// Record buffers are page aligned so that they can be used with O_DIRECT
+struct BufferDeleter
+{
+    void operator()(Block* blocks) const;
+};
+
+typedef std::unique_ptr<Block[], BufferDeleter> Buffer;
+
+// A record buffer while io_uring reads into it or writes from it
+struct RecordSlot
+{
+    Buffer                   data;
+    std::uint64_t            record_id; // the first record in data
+    std::uint32_t            size;
+    std::int32_t             result;
+    bool                     busy;
+};
+
 class BlockStream
 {
 public:
-    BlockStream(const std::string& file_path, std::uint32_t blocking_factor = 20);
+    BlockStream(const std::string& file_path,
+                std::uint32_t      blocking_factor = 20,
+                std::size_t        buffer_size     = DEFAULT_BUFFER_SIZE);
 
-    virtual ~BlockStream() = default;
+    virtual ~BlockStream();
 
     BlockStream(const BlockStream& other) = delete;
 
     BlockStream& operator=(const BlockStream& other) = delete;
 
-    std::uint32_t record_id();
+    std::uint64_t record_id();
 
     std::uint32_t block_id();
 
+    std::uint32_t blocking_factor();
+
+    const fs::path& file_path();
+
+    // In bytes, after rounding to whole records
+    std::size_t buffer_size();
+
 protected:
-    fs::path                 m_file_path;
-    std::uint32_t            m_blocking_factor;
-    std::uint32_t            m_block_id;
-    std::uint32_t            m_record_id;
-    std::unique_ptr<Block[]> m_record;
-    std::fstream             m_stream;
+    Block* current_block();
+
+    fs::path      m_file_path;
+    std::uint32_t m_blocking_factor;
+    std::uint32_t m_block_id;
+    std::uint64_t m_record_id;
+    std::uint32_t m_records_per_buffer;
+    std::uint32_t m_buffer_record; // where the current record is in m_record
+    Buffer        m_record;
+    int           m_fd;
+
+    // Used by the URING backend, false if io_uring is not available
+    bool start_ring();
+
+    // Wait for one request to complete and release its slot
+    Status complete_one();
+
+    // Wait for every request in flight. Buffers must not be freed before.
+    Status drain();
+
+    std::unique_ptr<Uring>  m_ring;
+    std::vector<RecordSlot> m_slots;
+    std::uint32_t           m_in_flight;
+    bool                    m_io_error;
 };
 
 class InStream : public BlockStream
 {
 public:
-    InStream(fs::path file_path, std::uint32_t blocking_factor = 20);
+    // Pipes, sockets and other files that can not seek are read forward
+    // only, with the STREAM backend
+    InStream(fs::path      file_path,
+             std::uint32_t blocking_factor = 20,
+             Backend       backend         = Backend::STREAM,
+             std::size_t   buffer_size     = DEFAULT_BUFFER_SIZE);
 
-    ~InStream() = default;
+    // Read an open descriptor, like stdin or a socket. The stream closes it.
+    InStream(int fd, std::uint32_t blocking_factor = 20, std::size_t buffer_size = DEFAULT_BUFFER_SIZE);
+
+    ~InStream();
 
     InStream(const InStream& other) = delete;
 
@@ -114,15 +335,67 @@ public:
 
     Status read_block(Block& raw, bool advance = true);
 
-    Status seek_record(std::uint32_t record_id);
+    // Point raw to the current block instead of copying it. The pointer is
+    // valid until the next call for STREAM and for the lifetime of the
+    // stream for MMAP.
+    Status view_block(const Block*& raw, bool advance = true);
+
+    // View the next size bytes of member data and skip its blocks. For MMAP
+    // the view points into the mapping, for STREAM into a buffer that is
+    // reused by the next call.
+    Status read_data(std::size_t size, View& view);
 
-    Status skip_blocks(std::uint32_t count);
+    // Without seekable, only forward seeks within or after the current
+    // buffer work, by reading and dropping the records in between. Seekable
+    // zstd archives are decoded from the frame that holds the record.
+    Status seek_record(std::uint64_t record_id);
+
+    Status skip_blocks(std::uint64_t count);
+
+    // View size bytes at offset without touching the stream position, so it
+    // can be called from several threads at once. For MMAP the view points
+    // into the mapping, otherwise the bytes are pread into buffer.
+    // Compressed archives and pipes can not be read at an offset and give
+    // ERROR.
+    Status read_at(std::uint64_t offset, std::size_t size, Data& buffer, View& view);
+
+    // Compressed archives are always read with the STREAM backend, and so
+    // is everything if io_uring is not available
+    Backend backend();
+
+    Codec codec();
+
+    // False for pipes, sockets and the like
+    bool seekable();
+
+    // Whole records in the file, only known for uncompressed archives that
+    // can seek
+    std::uint64_t record_count();
 
 private:
+    // Everything after the descriptor is open, closes it on errors
+    void setup();
+
     Status read_record();
 
-    std::uint32_t m_records_in_file;
-    bool          m_should_read;
+    Status read_record_async();
+
+    Status seek_frame(std::uint64_t record_id);
+
+    Backend                  m_backend;
+    Codec                    m_codec;
+    bool                     m_seekable;
+    std::uint64_t            m_records_in_file;
+    std::uint64_t            m_next_record;  // the record the next read returns
+    std::uint64_t            m_buffer_first; // the record at the start of m_record
+    std::uint32_t            m_buffered;     // records in m_record
+    bool                     m_should_read;
+    const Block*             m_map;
+    std::size_t              m_map_size;
+    Data                     m_data;
+    Data                     m_peek; // read from a pipe to find the codec
+    std::unique_ptr<Decoder> m_decoder;
+    std::vector<Frame>       m_frames; // of seekable zstd archives
 };
 
 class Parser
@@ -138,22 +411,132 @@ public:
 
     Status next_file(File& file);
 
-    Data read_file(File& file);
+    // The view stays valid until the next call(see InStream::read_data). For
+    // sparse members it is the data of the segments without the holes. Empty
+    // if the member can not be reached or read.
+    View read_file(const File& file);
+
+    // Called with the whole data of a member, from any of the threads
+    typedef std::function<Status(const File& file, View data)> FileCallback;
+
+    // Run callback for every member of files on a pool of threads(0 means
+    // one per core), each reading its members with read_at. Stops at the
+    // first ERROR. For STREAM every thread holds the member it works on in
+    // memory, MMAP views need none. Compressed archives are read serially.
+    Status for_each_file(const std::list<File>& files, const FileCallback& callback, std::uint32_t threads = 0);
 
-    Status list_files(std::list<File>& list);
+    // Only members that matcher selects are listed, the data of the others
+    // is skipped like that of every member. With more than one thread(0
+    // means one per core), uncompressed archives that can seek are split in
+    // ranges that are parsed at the same time, see scan.
+    Status list_files(std::list<File>& list, const Matcher* matcher = nullptr, std::uint32_t threads = 1);
+
+    // Like list_files, in far less memory for archives with many members
+    Status list_members(Listing& listing, const Matcher* matcher = nullptr);
+
+    // The data of a member from list_members, see read_file
+    View read_file(const Member& member);
+
+    // Scan the archive and find the block right after the data of its last
+    // member, where the end of archive zero blocks start
+    Status end_of_archive(std::uint64_t& block);
+
+    // Scan the archive and write a sorted name hash index next to it. threads
+    // is as for list_files.
+    Status write_index(const fs::path& index_path, std::uint32_t threads = 1);
+
+    Status load_index(const fs::path& index_path);
+
+    // Look a member up by name. With a loaded index this is a single seek,
+    // otherwise the archive is scanned from the start.
+    Status find(const std::string& name, File& file);
+
+    static std::uint64_t hash_name(const std::string& name);
+
+    // Recreate every member below dest in one sequential pass over the
+    // archive. With more than one thread, member data is written by a pool
+    // of writer threads while the archive is still being read. Members that
+    // matcher does not select are skipped.
+    Status extract_all(const fs::path& dest, std::uint32_t threads = 1, const Matcher* matcher = nullptr);
+
+    // Called for every member in archive order, false skips its data
+    typedef std::function<bool(const File& file)> MemberFilter;
+
+    // Called with consecutive chunks of the data of a member, offset is
+    // where chunk starts in it. Members without data get no calls. The view
+    // is only valid during the call.
+    typedef std::function<Status(const File& file, std::uint64_t offset, View chunk)> ChunkCallback;
+
+    // One forward pass from where the stream stands that never seeks back,
+    // so it works on pipes, sockets and stdin. Members are never held in
+    // memory as a whole, the data of skipped ones is read and dropped.
+    Status stream(const ChunkCallback& callback, const MemberFilter& filter = nullptr);
+
+    // Hash the data of regular files in one forward pass from the start and
+    // compare it with their digest records, or with manifest computed with
+    // digest if it is given. Mismatches and members missing from the archive
+    // are reported and counted in failed, sparse members are not checked.
+    Status check_digests(std::uint64_t& checked,
+                         std::uint64_t& failed,
+                         const Manifest* manifest = nullptr,
+                         Digest          digest   = Digest::NONE);
 
 private:
-    Status check_block(Block& block);
+    // PAX extended header records by keyword
+    typedef std::unordered_map<std::string, std::string> Records;
+
+    struct Range;
+
+    // Every member in archive order, from ranges of the archive parsed on
+    // a stream per thread. Ranges other than the first start at the first
+    // block that looks like a header, which may well be in the data of a
+    // member, so each is checked against where the one before it ended and
+    // parsed again from there if they differ. END if the archive can not be
+    // scanned like that and has to be read in order. starts gets the block
+    // of the first header of each member, which is before the header itself
+    // if the member has extended headers.
+    Status scan(std::list<File>& files, std::vector<std::uint64_t>& starts, std::uint32_t threads);
+
+    // search looks for the first header in the range instead of starting
+    // at its beginning
+    void scan_range(Range& range, bool search);
 
-    Data unpack(const Header& header);
+    Status check_block(const Block& block);
 
-    InStream& m_stream;
+    View unpack(std::uint64_t size);
+
+    Status read_sparse_map(File& file);
+
+    InStream&               m_stream;
+    std::vector<IndexEntry> m_index;
+    Records                 m_global_records; // from 'g' headers, for every member after them
+
+    // Scratch space of next_file, kept so that its buffers are reused
+    Records     m_records;
+    std::string m_long_name;
+    std::string m_long_link;
 };
 
 class OutStream : public BlockStream
 {
 public:
-    OutStream(const std::string& file_path, std::uint32_t blocking_factor = 20);
+    // threads only matters for zstd, which can compress on several threads.
+    // The URING backend is used for uncompressed archives if available.
+    // direct opens uncompressed archives with O_DIRECT to keep them out of
+    // the page cache, the buffer is then grown to a multiple of the page size.
+    // append keeps the members of an existing uncompressed archive and writes
+    // over its end of archive blocks.
+    // seekable compresses zstd archives in frames that start at member
+    // boundaries and adds a seek table, so InStream can jump to a member.
+    OutStream(const std::string& file_path,
+              std::uint32_t      blocking_factor = 20,
+              Codec              codec           = Codec::NONE,
+              std::uint32_t      threads         = 1,
+              Backend            backend         = Backend::STREAM,
+              std::size_t        buffer_size     = DEFAULT_BUFFER_SIZE,
+              bool               direct          = false,
+              bool               append          = false,
+              bool               seekable        = false);
 
     ~OutStream();
 
@@ -165,14 +548,150 @@ public:
 
     Status write_blocks(const std::vector<Block>& blocks);
 
+    // Copy size bytes from fd, padding the last block with zeros. When the
+    // archive is a regular file the whole blocks are moved by the kernel
+    // (copy_file_range, then sendfile), otherwise they go through the record
+    // buffer. At most one buffer is held in memory either way(one per slot
+    // with URING). digest is fed the bytes as they go through the buffer, the
+    // kernel copies are not used then.
+    Status write_data(int fd, std::size_t size, Hasher* digest = nullptr);
+
+    Status write_data(View data);
+
+    // Called before the first block of every member. Seekable archives start
+    // a new frame here once the current one holds FRAME_SIZE bytes.
+    Status member_boundary();
+
+    // Write out what is left in the buffer, finish the compressed stream and
+    // close the file. The destructor does it too, but can not report a
+    // failed last write. Calling it again returns the first result.
+    Status close();
+
 private:
+    enum class CopyMethod
+    {
+        COPY_FILE_RANGE,
+        SENDFILE,
+        READ_WRITE
+    };
+
+    Status copy_blocks(int fd, std::size_t size);
+
+    Status write_pending(bool rotate = false);
+
+    Status next_block();
+
+    void advance(std::uint64_t blocks);
+
     Status flush_record();
+
+    void find_end();
+
+    CopyMethod               m_copy_method;
+    bool                     m_direct;
+    bool                     m_append;
+    std::uint32_t            m_written; // blocks of the buffer already in the file
+    std::uint64_t            m_offset;  // where the next write goes in the file
+    std::unique_ptr<Encoder> m_encoder;
+    bool                     m_seekable;
+    Status                   m_close_status;
+};
+
+// A fixed set of worker threads that run submitted tasks in FIFO order
+class ThreadPool
+{
+public:
+    ThreadPool(std::uint32_t threads);
+
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool& other) = delete;
+
+    ThreadPool& operator=(const ThreadPool& other) = delete;
+
+    template <typename Task>
+    std::future<std::invoke_result_t<Task>> submit(Task&& task)
+    {
+        auto packaged = std::make_shared<std::packaged_task<std::invoke_result_t<Task>()>>(std::forward<Task>(task));
+        auto future   = packaged->get_future();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tasks.push([packaged]()
+                         { (*packaged)(); });
+        }
+        m_condition.notify_one();
+
+        return future;
+    }
+
+private:
+    void work();
+
+    std::vector<std::thread>          m_threads;
+    std::queue<std::function<void()>> m_tasks;
+    std::mutex                        m_mutex;
+    std::condition_variable           m_condition;
+    bool                              m_stop;
+};
+
+// Remembers the user and group names of ids, since every lookup may be a
+// round trip to LDAP/sssd. Safe to use from several threads, ids without
+// a name are remembered as "".
+class NameCache
+{
+public:
+    NameCache() = default;
+
+    NameCache(const NameCache& other) = delete;
+
+    NameCache& operator=(const NameCache& other) = delete;
+
+    std::string user(std::uint32_t uid);
+
+    std::string group(std::uint32_t gid);
+
+    std::uint64_t hits() const;
+
+    std::uint64_t misses() const;
+
+private:
+    typedef std::unordered_map<std::uint32_t, std::string> Names;
+
+    std::string find(Names& names, std::uint32_t id, bool is_user);
+
+    Names                      m_users;
+    Names                      m_groups;
+    std::mutex                 m_mutex;
+    std::atomic<std::uint64_t> m_hits   = 0;
+    std::atomic<std::uint64_t> m_misses = 0;
 };
 
 class Archiver
 {
 public:
-    Archiver() = default;
+    // With more than one thread, a pool of workers stats, lists and reads
+    // entries ahead of the single writer. 0 means one thread per core.
+    // numeric_owner leaves uname and gname empty instead of looking them up.
+    // sparse looks for holes in regular files and stores the files that have
+    // them as PAX 1.0 sparse members.
+    // Later links to an inode are always stored as hard links. dedupe also
+    // stores later copies of a regular file as hard links to the first one.
+    // Only the paths matcher selects are archived, directories it can not
+    // select anything below are not read at all.
+    // records puts the digest of a regular file in a TARTOOLS.<digest> record
+    // when its data is read before the header is written: files of up to
+    // 256 KiB, and with dedupe every file, which it reads ahead for its hash
+    // anyway. manifest hashes every regular file for digests(), the others
+    // while the writer copies them. Sparse files are not hashed. If both are
+    // set they have to be the same digest.
+    Archiver(std::uint32_t threads       = 1,
+             bool          numeric_owner = false,
+             Format        format        = Format::GNU,
+             bool          sparse        = false,
+             bool          dedupe        = false,
+             Matcher       matcher       = Matcher(),
+             Digest        records       = Digest::NONE,
+             Digest        manifest      = Digest::NONE);
 
     ~Archiver() = default;
 
@@ -180,16 +699,91 @@ public:
 
     Archiver& operator=(const Archiver& other) = delete;
 
-    Status archive(const fs::path& src, const fs::path& dest, std::uint32_t blocking_factor = 20);
+    Status archive(const fs::path& src,
+                   const fs::path& dest,
+                   std::uint32_t   blocking_factor = 20,
+                   Codec           codec           = Codec::NONE);
+
+    // Archive into a stream the caller has set up, which is closed after the
+    // end of archive blocks
+    Status archive(const fs::path& src, OutStream& out_stream);
+
+    // Incremental archive: entries whose mtime and size match the snapshot
+    // written by the previous run are left out, then the snapshot is replaced
+    // by the current state. A missing snapshot archives everything. Directories
+    // are always archived, deleted entries are not recorded.
+    Status archive(const fs::path& src, OutStream& out_stream, const fs::path& snapshot);
+
+    std::uint32_t threads() const;
+
+    // Shared by every archive call of this Archiver
+    const NameCache& names() const;
+
+    // Member names and digests from the last archive call, in archive order
+    const std::vector<std::pair<std::string, std::string>>& digests() const;
 
 private:
-    Status create_header(const fs::path& path, Block& header_block);
+    struct Entry;
+    struct Directory;
+    struct Node;
+
+    // A regular file archived with its data, that later copies can link to
+    struct Original
+    {
+        fs::path      path;
+        std::uint64_t size;
+        Block         header;
+    };
+
+    typedef std::vector<SnapshotEntry> Snapshot;
+
+    // By device and inode, and by content hash
+    typedef std::map<std::pair<std::uint64_t, std::uint64_t>, std::string> Inodes;
+    typedef std::unordered_multimap<std::uint64_t, Original>               Originals;
+
+    // previous is searched for unchanged entries if set, the state of every
+    // archived entry is added to current if set
+    Status walk(const fs::path& src, OutStream& out_stream, const Snapshot* previous, Snapshot* current);
+
+    void prepare(const Node& node, Entry& entry, bool prefetch, const Snapshot* previous);
+
+    void read_contents(Entry& entry);
+
+    void link_duplicate(Entry& entry, Inodes& inodes, Originals& originals);
+
+    void link_entry(Entry& entry, const std::string& target);
+
+    Status list_directory(const Node& node, std::vector<Node>& children);
+
+    // link gets the whole target of symbolic links, which may not fit in
+    // the header
+    Status create_header(const Node& node, Block& header_block, Entry& entry, std::string& link);
+
+    // Puts the header in entry.blocks after whatever extended header it needs.
+    // records are PAX records that must go in any case.
+    void create_blocks(Entry& entry, const Block& header_block, const std::string& link, std::string records);
+
+    // A member of the given type whose data describes the next header, like
+    // a @LongLink name or PAX records
+    void create_extended_blocks(const char*         name,
+                                char                typeflag,
+                                const std::string&  data,
+                                std::vector<Block>& blocks,
+                                const Header&       real_header);
+
+    Status pack(const fs::path& path, std::size_t size, OutStream& out_stream, Hasher* digest = nullptr);
 
-    void create_long_name_blocks(const std::string&  path,
-                                 std::vector<Block>& blocks,
-                                 const Header&       real_header);
+    std::uint32_t m_threads;
+    bool          m_numeric_owner;
+    Format        m_format;
+    bool          m_sparse;
+    bool          m_dedupe;
+    Matcher       m_matcher;
+    Digest        m_records;
+    Digest        m_manifest;
+    NameCache     m_names;
 
-    Status pack(const fs::path& path, std::vector<Block>& blocks);
+    std::vector<std::pair<std::string, std::string>> m_digests;
 };
 }
 #endif // TARSTREAM_HH
@@ -0,0 +1,163 @@
+#include "uring.hh"
+#include "stats.hh"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace TAR
+{
+Uring::Uring(std::uint32_t entries)
+    : m_queued(0)
+    , m_cq_ring(nullptr)
+    , m_cq_ring_size(0)
+{
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+
+    m_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (m_fd < 0)
+        throw std::runtime_error("io_uring is not available");
+
+    m_entries      = params.sq_entries;
+    m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    m_sqes_size    = params.sq_entries * sizeof(io_uring_sqe);
+
+    // Since 5.4 both rings live in a single mapping
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+        m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+
+    m_sq_ring = mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_sq_ring == MAP_FAILED)
+    {
+        close(m_fd);
+        throw std::runtime_error("Could not map the io_uring submission ring");
+    }
+
+    if (single_mmap)
+        m_cq_ring = m_sq_ring;
+    else
+    {
+        m_cq_ring = mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if (m_cq_ring == MAP_FAILED)
+        {
+            munmap(m_sq_ring, m_sq_ring_size);
+            close(m_fd);
+            throw std::runtime_error("Could not map the io_uring completion ring");
+        }
+    }
+
+    void* sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        if (!single_mmap)
+            munmap(m_cq_ring, m_cq_ring_size);
+        munmap(m_sq_ring, m_sq_ring_size);
+        close(m_fd);
+        throw std::runtime_error("Could not map the io_uring submission entries");
+    }
+    m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+    auto sq    = static_cast<char*>(m_sq_ring);
+    auto cq    = static_cast<char*>(m_cq_ring);
+    m_sq_head  = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    m_sq_tail  = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    m_sq_mask  = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    m_cq_head  = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    m_cq_tail  = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    m_cq_mask  = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    m_cqes     = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+Uring::~Uring()
+{
+    munmap(m_sqes, m_sqes_size);
+    if (m_cq_ring != m_sq_ring)
+        munmap(m_cq_ring, m_cq_ring_size);
+    munmap(m_sq_ring, m_sq_ring_size);
+    close(m_fd);
+}
+
+Status Uring::queue_read(int fd, void* data, std::uint32_t size, off_t offset, std::uint64_t tag)
+{
+    return queue(IORING_OP_READ, fd, data, size, offset, tag);
+}
+
+Status Uring::queue_write(int fd, const void* data, std::uint32_t size, off_t offset, std::uint64_t tag)
+{
+    return queue(IORING_OP_WRITE, fd, data, size, offset, tag);
+}
+
+Status Uring::queue(std::uint8_t opcode, int fd, const void* data, std::uint32_t size, off_t offset, std::uint64_t tag)
+{
+    unsigned tail = *m_sq_tail;
+    if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_entries)
+        return Status::ERROR;
+
+    unsigned      index = tail & *m_sq_mask;
+    io_uring_sqe* sqe   = &m_sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = opcode;
+    sqe->fd        = fd;
+    sqe->addr      = reinterpret_cast<std::uint64_t>(data);
+    sqe->len       = size;
+    sqe->off       = offset;
+    sqe->user_data = tag;
+
+    m_sq_array[index] = index;
+    __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    m_queued++;
+
+    return Status::OK;
+}
+
+Status Uring::submit()
+{
+    while (m_queued)
+    {
+        int submitted = enter(m_queued, 0, 0);
+        if (submitted < 0)
+            return Status::ERROR;
+        m_queued -= submitted;
+    }
+
+    return Status::OK;
+}
+
+Status Uring::wait(std::uint64_t& tag, std::int32_t& result)
+{
+    while (true)
+    {
+        unsigned head = *m_cq_head;
+        if (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+        {
+            const io_uring_cqe& cqe = m_cqes[head & *m_cq_mask];
+            tag                     = cqe.user_data;
+            result                  = cqe.res;
+            __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+
+            return Status::OK;
+        }
+
+        if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0)
+            return Status::ERROR;
+    }
+}
+
+int Uring::enter(std::uint32_t to_submit, std::uint32_t min_complete, std::uint32_t flags)
+{
+    int ret;
+    TAR_COUNT(SYSCALLS, 1);
+    do
+        ret = syscall(__NR_io_uring_enter, m_fd, to_submit, min_complete, flags, nullptr, 0);
+    while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+}
@@ -0,0 +1,60 @@
+#ifndef URING_HH
+#define URING_HH
+
+#include "tarstream.hh"
+#include <sys/types.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace TAR
+{
+// A small io_uring wrapper for positional reads and writes, talking to the
+// kernel directly so that liburing is not needed
+class Uring
+{
+public:
+    // Throws std::runtime_error if the kernel does not support io_uring
+    Uring(std::uint32_t entries);
+
+    ~Uring();
+
+    Uring(const Uring& other) = delete;
+
+    Uring& operator=(const Uring& other) = delete;
+
+    // Queue a request. Nothing reaches the kernel before submit.
+    Status queue_read(int fd, void* data, std::uint32_t size, off_t offset, std::uint64_t tag);
+
+    Status queue_write(int fd, const void* data, std::uint32_t size, off_t offset, std::uint64_t tag);
+
+    Status submit();
+
+    // Wait for the next completion. result is the byte count or -errno.
+    Status wait(std::uint64_t& tag, std::int32_t& result);
+
+private:
+    Status queue(std::uint8_t opcode, int fd, const void* data, std::uint32_t size, off_t offset, std::uint64_t tag);
+
+    int enter(std::uint32_t to_submit, std::uint32_t min_complete, std::uint32_t flags);
+
+    int           m_fd;
+    std::uint32_t m_entries;
+    std::uint32_t m_queued;
+    void*         m_sq_ring;
+    std::size_t   m_sq_ring_size;
+    void*         m_cq_ring;
+    std::size_t   m_cq_ring_size;
+    io_uring_sqe* m_sqes;
+    std::size_t   m_sqes_size;
+    unsigned*     m_sq_head;
+    unsigned*     m_sq_tail;
+    unsigned*     m_sq_mask;
+    unsigned*     m_sq_array;
+    unsigned*     m_cq_head;
+    unsigned*     m_cq_tail;
+    unsigned*     m_cq_mask;
+    io_uring_cqe* m_cqes;
+};
+}
+#endif // URING_HH